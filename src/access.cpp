@@ -0,0 +1,160 @@
+﻿#include "stdafx.h"
+#include "access.h"
+
+//----------------------------------------------------------------------------
+/// @class Access::Impl
+/// rules sharing a name pattern form a group with a binary prefix tree per address family;
+/// a tree node holds the smallest order of the entries ending there, deny (2*i) before allow (2*i+1)
+//----------------------------------------------------------------------------
+class Access::Impl
+{
+    static const uint32_t NONE = 0xffffffffu;
+    struct Node {
+        uint32_t child[2];
+        uint32_t order;
+    };
+    struct Group {
+        std::string pattern;
+        bool any;       // matches every name
+        uint32_t wild;  // order of "*" and "all"
+        uint32_t v4;    // root nodes
+        uint32_t v6;
+    };
+    std::vector<Node> nodes_;
+    std::vector<Group> groups_;
+    size_t rules_;
+public:
+    Impl(const Json::Node& access) : nodes_(), groups_(), rules_(access.size()) {
+        for (size_t i = 0; i < rules_; ++i) {
+            Group& group = GetGroup(access[i]["name"].to<std::string>("*"));
+            Add(group, access[i]["deny"].to<std::string>(), static_cast<uint32_t>(i * 2));
+            Add(group, access[i]["allow"].to<std::string>(), static_cast<uint32_t>(i * 2 + 1));
+        }
+    }
+    virtual ~Impl() {
+    }
+    virtual size_t Rules() const {
+        return rules_;
+    }
+    virtual bool Check(const SockAddr& addr, const std::string& name, int* rule) const {
+        uint32_t order = NONE;
+        for (std::vector<Group>::const_iterator it = groups_.begin(); it != groups_.end(); ++it) {
+            if (!it->any && !Glob(it->pattern, name)) continue;
+            order = std::min(order, it->wild);
+            if (addr.IsV4()) {
+                const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&reinterpret_cast<const sockaddr_in*>(&addr)->sin_addr.s_addr);
+                order = std::min(order, Find(it->v4, bytes, 32));
+            } else if (addr.IsV6()) {
+                const uint8_t* bytes = reinterpret_cast<const sockaddr_in6*>(&addr)->sin6_addr.s6_addr;
+                order = std::min(order, Find(it->v6, bytes, 128));
+            }
+        }
+        if (rule) *rule = (order == NONE) ? -1 : static_cast<int>(order / 2);
+        return order == NONE || (order % 2) == 1;
+    }
+protected:
+    virtual uint32_t NewNode() {
+        Node node = { { NONE, NONE }, NONE };
+        nodes_.push_back(node);
+        return static_cast<uint32_t>(nodes_.size() - 1);
+    }
+    virtual Group& GetGroup(const std::string& pattern) {
+        std::string compact;
+        for (std::string::const_iterator it = pattern.begin(); it != pattern.end(); ++it) {
+            if (*it == '*' && !compact.empty() && *compact.rbegin() == '*') continue; // "**" -> "*"
+            compact += *it;
+        }
+        bool any = compact.empty() || compact == "*";
+        for (std::vector<Group>::iterator it = groups_.begin(); it != groups_.end(); ++it) {
+            if (any ? it->any : (!it->any && it->pattern == compact)) return *it;
+        }
+        Group group = { compact, any, NONE, NewNode(), NewNode() };
+        groups_.push_back(group);
+        return groups_.back();
+    }
+    virtual void Add(Group& group, const std::string& cond, uint32_t order) {
+        if (cond.empty()) return;
+        if (cond == "*" || boost::iequals(cond, "all")) {
+            group.wild = std::min(group.wild, order);
+            return;
+        }
+        const size_t pos = cond.find_first_of('/');
+        SockAddr addr(cond.substr(0, pos).c_str(), nullptr);
+        int32_t len = -1;
+        if (pos != std::string::npos) {
+            try {
+                len = boost::lexical_cast<int32_t>(cond.substr(pos + 1));
+            } catch (boost::bad_lexical_cast&) {
+                return; // never matches
+            }
+        }
+        if (addr.IsV4()) {
+            const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&reinterpret_cast<const sockaddr_in*>(&addr)->sin_addr.s_addr);
+            Insert(group.v4, bytes, (len < 0 || len > 32) ? 32 : len, order);
+        } else if (addr.IsV6()) {
+            const uint8_t* bytes = reinterpret_cast<const sockaddr_in6*>(&addr)->sin6_addr.s6_addr;
+            Insert(group.v6, bytes, (len < 0 || len > 128) ? 128 : len, order);
+        }
+    }
+    virtual void Insert(uint32_t node, const uint8_t* bytes, int32_t bits, uint32_t order) {
+        for (int32_t i = 0; i < bits; ++i) {
+            int bit = (bytes[i / 8] >> (7 - i % 8)) & 1;
+            uint32_t next = nodes_[node].child[bit];
+            if (next == NONE) {
+                next = NewNode(); // may move nodes_
+                nodes_[node].child[bit] = next;
+            }
+            node = next;
+        }
+        nodes_[node].order = std::min(nodes_[node].order, order);
+    }
+    virtual uint32_t Find(uint32_t node, const uint8_t* bytes, int32_t bits) const {
+        uint32_t order = nodes_[node].order;
+        for (int32_t i = 0; i < bits; ++i) {
+            node = nodes_[node].child[(bytes[i / 8] >> (7 - i % 8)) & 1];
+            if (node == NONE) break;
+            order = std::min(order, nodes_[node].order);
+        }
+        return order;
+    }
+};
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+bool Access::Glob(const std::string& pattern, const std::string& str) {
+    // linear scan which backtracks only to the last "*"
+    size_t p = 0, s = 0, star = std::string::npos, mark = 0;
+    while (s < str.size()) {
+        if (p < pattern.size() && pattern[p] == '*') {
+            star = ++p;
+            mark = s;
+        } else if (p < pattern.size() && (pattern[p] == '%' || pattern[p] == str[s])) {
+            ++p;
+            ++s;
+        } else if (star != std::string::npos) {
+            p = star;
+            s = ++mark;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') ++p;
+    return p == pattern.size();
+}
+
+Access::ptr_t Access::Create(const Json::Node& access) {
+    return Access::ptr_t(new Access(access));
+}
+Access::Access(const Json::Node& access)
+    : pimpl_(new Impl(access)) {
+}
+Access::~Access() {
+    pimpl_.reset();
+}
+size_t Access::Rules() const {
+    return pimpl_->Rules();
+}
+bool Access::Check(const SockAddr& addr, const std::string& name, int* rule) const {
+    return pimpl_->Check(addr, name, rule);
+}
@@ -0,0 +1,24 @@
+﻿#pragma once
+
+#include "json.h"
+#include "sockaddr.h"
+
+//----------------------------------------------------------------------------
+/// @class Access
+/// "access" rules compiled once into name patterns and address prefix trees
+//----------------------------------------------------------------------------
+class Access : private boost::noncopyable
+{
+    class Impl;
+    boost::scoped_ptr<Impl> pimpl_;
+    Access(const Json::Node& access);
+public:
+    typedef boost::shared_ptr<const Access> ptr_t;
+    static ptr_t Create(const Json::Node& access);
+    virtual ~Access();
+    virtual size_t Rules() const;
+    // the first matching rule decides and the address is allowed if no rule matches
+    // rule: index of the deciding rule (-1:none)
+    virtual bool Check(const SockAddr& addr, const std::string& name, int* rule = nullptr) const;
+    static bool Glob(const std::string& pattern, const std::string& str); // "*":any string, "%":any character
+};
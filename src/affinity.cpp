@@ -0,0 +1,126 @@
+﻿#include "stdafx.h"
+#include "affinity.h"
+#include "logger.h"
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+//----------------------------------------------------------------------------
+/// @class Affinity::Config
+//----------------------------------------------------------------------------
+class Affinity::Config
+{
+public:
+    struct Role {
+        std::string cpus; // e.g. "0-3,8"
+        std::vector<int> cpuset;
+        int fifo;         // SCHED_FIFO priority (0:normal scheduling)
+        int nice;
+        bool enabled;
+    };
+    Role roles_[ROLES];
+    Config(const Json::Node& conf) {
+        static const char* names[ROLES] = { "listener", "receiver", "recorder", "playback", "uploader" };
+        for (int i = 0; i < ROLES; ++i) {
+            Role& role = roles_[i];
+            role.cpus = conf[names[i]]["cpus"].to<std::string>("");
+            role.cpuset = Parse(role.cpus);
+            role.fifo = conf[names[i]]["fifo"].to<int>(0);
+            role.nice = conf[names[i]]["nice"].to<int>(0);
+            role.enabled = !role.cpuset.empty() || role.fifo > 0 || role.nice != 0;
+            if (!role.enabled) continue;
+            Logger::Info(boost::format("affinity : %s threads on cpus [%s] fifo:%d nice:%d")
+                % names[i] % (role.cpus.empty() ? "any" : role.cpus) % role.fifo % role.nice);
+        }
+    }
+    static std::vector<int> Parse(const std::string& cpus) {
+        std::vector<int> cpuset;
+        std::vector<std::string> ranges;
+        boost::split(ranges, cpus, boost::is_any_of(","));
+        for (std::vector<std::string>::const_iterator it = ranges.begin(); it != ranges.end(); ++it) {
+            std::string range = boost::trim_copy(*it);
+            if (range.empty()) continue;
+            try {
+                size_t dash = range.find('-');
+                int first = boost::lexical_cast<int>(boost::trim_copy(range.substr(0, dash)));
+                int last = dash == std::string::npos ? first : boost::lexical_cast<int>(boost::trim_copy(range.substr(dash + 1)));
+                for (int cpu = first; cpu <= last; ++cpu) cpuset.push_back(cpu);
+            } catch (boost::bad_lexical_cast&) {
+                Logger::Warning(boost::format("affinity : invalid cpus [%s]") % cpus);
+            }
+        }
+        return cpuset;
+    }
+};
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+Affinity::pconf_t Affinity::pconf_;
+boost::atomic<bool> Affinity::active_(false);
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+bool Affinity::Init(const Json::Node& conf) {
+    if (pconf_) {
+        active_ = true;
+        return true;
+    }
+    pconf_.reset(new Config(conf));
+#if !defined(__linux__)
+    for (int i = 0; i < ROLES; ++i) {
+        if (pconf_->roles_[i].enabled) {
+            Logger::Warning("affinity : not supported on this platform");
+            break;
+        }
+    }
+#endif
+    active_ = true;
+    return true;
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+void Affinity::Term() {
+    // the table is not released: detached S3 uploaders may still start
+    active_ = false;
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+void Affinity::Apply(role_t role) {
+    if (!active_) return;
+    const Config::Role& conf = pconf_->roles_[role];
+    if (!conf.enabled) return;
+#if defined(__linux__)
+    if (!conf.cpuset.empty()) {
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        for (std::vector<int>::const_iterator it = conf.cpuset.begin(); it != conf.cpuset.end(); ++it) {
+            if (*it >= 0 && *it < CPU_SETSIZE) CPU_SET(*it, &cpuset);
+        }
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+        if (err) Logger::Warning(boost::format("affinity : failed pthread_setaffinity_np() [%s]: %s") % conf.cpus % strerror(err));
+    }
+    if (conf.fifo > 0) {
+        sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = conf.fifo;
+        int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err) Logger::Warning(boost::format("affinity : failed pthread_setschedparam(SCHED_FIFO, %d): %s") % conf.fifo % strerror(err));
+    } else if (conf.nice != 0) {
+        pid_t tid = static_cast<pid_t>(syscall(SYS_gettid)); // nice is per thread on Linux
+        if (setpriority(PRIO_PROCESS, static_cast<id_t>(tid), conf.nice) != 0) {
+            Logger::Warning(boost::format("affinity : failed setpriority(%d): %s") % conf.nice % strerror(errno));
+        }
+    }
+#endif
+}
@@ -0,0 +1,29 @@
+﻿#pragma once
+
+#include "json.h"
+
+//----------------------------------------------------------------------------
+/// @class Affinity
+/// cpu sets and scheduling of the threads per role (Linux only)
+//----------------------------------------------------------------------------
+class Affinity
+{
+public:
+    enum role_t {
+        LISTENER,
+        RECEIVER, // receiver threads and reactor threads
+        RECORDER, // loop recording writer
+        PLAYBACK, // fanout workers and loop recording players
+        UPLOADER, // S3 upload and segment removal
+        ROLES
+    };
+private:
+    class Config;
+    typedef boost::scoped_ptr<Config> pconf_t;
+    static pconf_t pconf_;             // kept until the process exits for detached threads
+    static boost::atomic<bool> active_;
+public:
+    static bool Init(const Json::Node& conf);
+    static void Term();
+    static void Apply(role_t role); // to the calling thread; nothing after Term()
+};
@@ -0,0 +1,270 @@
+﻿#include "stdafx.h"
+#include "auth.h"
+#include "logger.h"
+#include "affinity.h"
+#include "timer.h"
+
+//----------------------------------------------------------------------------
+/// @class Auth::Pool
+/// pending-decision table and the workers which fill it;
+/// callers with the same key share one webhook call (single-flight)
+//----------------------------------------------------------------------------
+class Auth::Pool : private boost::noncopyable
+{
+    struct Decision {
+        bool done;
+        bool deferred;                      // a caller gave up waiting and will retry
+        CURLcode res;
+        Json body;
+        boost::chrono::steady_clock::time_point expire;
+        Decision() : done(false), deferred(false), res(CURL_LAST), body(), expire() {}
+    };
+    typedef boost::shared_ptr<Decision> decision_t;
+    typedef std::map<std::string, decision_t> decisions_t;
+    struct Job {
+        decision_t decision;
+        perform_t perform;
+        hold_t hold;
+        Json body;
+    };
+    typedef std::deque<Job> jobs_t;
+    const size_t limit_;                    // queued jobs
+    const boost::chrono::milliseconds hold_; // keep the decision for the retrying caller
+    decisions_t decisions_;
+    jobs_t jobs_;
+    boost::thread_group threads_;
+    boost::mutex mutex_;
+    boost::condition_variable cond_;        // jobs queued
+    boost::condition_variable decided_;     // decisions made
+    Timer::id_t sweep_;
+    size_t size_;
+    boost::atomic<uint64_t> requests_;
+    boost::atomic<uint64_t> performed_;
+    boost::atomic<uint64_t> shared_;
+    boost::atomic<uint64_t> deferred_;
+    boost::atomic<uint64_t> overflowed_;
+public:
+    Pool(size_t limit, int32_t hold)
+        : limit_(limit), hold_(hold), decisions_(), jobs_(), threads_(), mutex_(), cond_(), decided_(), sweep_(0), size_(0),
+        requests_(0), performed_(0), shared_(0), deferred_(0), overflowed_(0) {
+    }
+    virtual ~Pool() {
+        Destroy();
+    }
+    virtual bool Initialize(size_t threads) {
+        for (size_t i = 0; i < threads; ++i) {
+            threads_.create_thread([this]() { Thread(); });
+        }
+        size_ = threads;
+        sweep_ = Timer::Schedule(1000, [this]() { Sweep(); return 1000; });
+        return true;
+    }
+    virtual void Destroy() {
+        Timer::Cancel(sweep_);
+        sweep_ = 0;
+        threads_.interrupt_all();
+        cond_.notify_all();
+        threads_.join_all();
+        boost::mutex::scoped_lock lock(mutex_);
+        for (jobs_t::iterator it = jobs_.begin(); it != jobs_.end(); ++it) {
+            it->decision->res = CURLE_ABORTED_BY_CALLBACK;
+            it->decision->done = true;
+        }
+        jobs_.clear();
+        decisions_.clear();
+        decided_.notify_all();
+        size_ = 0;
+    }
+    virtual size_t Size() const {
+        return size_;
+    }
+    virtual CURLcode Decide(const std::string& key, const perform_t& perform, const hold_t& hold, Json& body, int32_t wait) {
+        ++requests_;
+        boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now();
+        boost::mutex::scoped_lock lock(mutex_);
+        decision_t decision;
+        decisions_t::iterator it = decisions_.find(key);
+        if (it != decisions_.end()) {
+            if (!it->second->done || now < it->second->expire) {
+                decision = it->second;
+                ++shared_;
+            } else {
+                decisions_.erase(it);
+            }
+        }
+        if (!decision) {
+            if (limit_ > 0 && jobs_.size() >= limit_) {
+                ++overflowed_;
+                return CURLE_AGAIN;
+            }
+            decision.reset(new Decision());
+            decisions_[key] = decision;
+            Job job = { decision, perform, hold, body };
+            if (size_ == 0) {
+                // no workers; the first caller performs and the others wait for it
+                lock.unlock();
+                Run(job);
+                lock.lock();
+            } else {
+                jobs_.push_back(job);
+                cond_.notify_one();
+            }
+        }
+        if (wait < 0) {
+            decided_.wait(lock, [&decision]() { return decision->done; });
+        } else if (!decided_.wait_for(lock, boost::chrono::milliseconds(wait), [&decision]() { return decision->done; })) {
+            decision->deferred = true;
+            ++deferred_;
+            return CURLE_AGAIN;
+        }
+        body = decision->body;
+        return decision->res;
+    }
+    virtual std::string GetStatistics(const std::string& sep) {
+        size_t queued = 0, decisions = 0;
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            queued = jobs_.size();
+            decisions = decisions_.size();
+        }
+        std::stringstream ss;
+        ss << "authRequests:" << requests_ << sep;     // number of authorizations requested
+        ss << "authPerformed:" << performed_ << sep;   // number of authorizations resolved by the workers
+        ss << "authShared:" << shared_ << sep;         // number of requests answered by a pending or held decision
+        ss << "authDeferred:" << deferred_ << sep;     // number of requests which gave up waiting for the decision
+        ss << "authOverflowed:" << overflowed_ << sep; // number of requests refused because the queue was full
+        ss << "authQueued:" << queued << sep;          // number of jobs waiting for a worker
+        ss << "authDecisions:" << decisions;           // number of decisions pending or held
+        return ss.str();
+    }
+protected:
+    virtual void Sweep() {
+        // called on the timer thread every second
+        boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now();
+        boost::mutex::scoped_lock lock(mutex_);
+        for (decisions_t::iterator it = decisions_.begin(); it != decisions_.end();) {
+            if (it->second->done && now >= it->second->expire) {
+                it = decisions_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    virtual Job Pop() {
+        boost::mutex::scoped_lock lock(mutex_);
+        cond_.wait(lock, [this]() {
+            if (!jobs_.empty()) return true;
+            boost::this_thread::interruption_point();
+            return false;
+        });
+        Job job = jobs_.front();
+        jobs_.pop_front();
+        return job;
+    }
+    virtual void Run(Job& job) {
+        // a failing webhook denies its own request only; the worker goes on with the next job
+        CURLcode res = CURL_LAST;
+        try {
+            res = job.perform(job.body);
+        } catch (boost::thread_interrupted&) {
+            Complete(job, CURLE_ABORTED_BY_CALLBACK);
+            throw;
+        } catch (std::exception& ex) {
+            Logger::Error(boost::format("auth : an unexpected exception occurred: %s") % ex.what());
+            res = CURLE_ABORTED_BY_CALLBACK;
+        } catch (...) {
+            Logger::Error("auth : an unexpected exception occurred");
+            res = CURLE_ABORTED_BY_CALLBACK;
+        }
+        Complete(job, res);
+    }
+    virtual void Complete(Job& job, CURLcode res) {
+        ++performed_;
+        boost::chrono::milliseconds cap = hold_;
+        if (job.hold) cap = std::min(cap, boost::chrono::milliseconds(std::max<int32_t>(job.hold(res), 0)));
+        boost::mutex::scoped_lock lock(mutex_);
+        // a deferred caller is answered at once when it retries, even if the result is not cached
+        boost::chrono::milliseconds hold = job.decision->deferred ? hold_ : cap;
+        job.decision->res = res;
+        job.decision->body = job.body;
+        job.decision->expire = boost::chrono::steady_clock::now() + hold;
+        job.decision->done = true;
+        decided_.notify_all();
+    }
+    virtual void Thread() {
+        Affinity::Apply(Affinity::LISTENER);
+        try {
+            for (;;) {
+                Job job = Pop();
+                Run(job);
+            }
+        } catch (boost::thread_interrupted&) {
+        } catch (std::exception& ex) {
+            Logger::Error(boost::format("auth : an unexpected exception occurred: %s") % ex.what());
+        }
+    }
+};
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+Auth::ppool_t Auth::ppool_;
+int32_t Auth::wait_ = 100;
+int32_t Auth::acceptWait_ = 6000;
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+bool Auth::Init(const Json::Node& conf) {
+    if (ppool_) return true;
+    wait_ = conf["wait"].to<int32_t>(100);
+    acceptWait_ = std::max<int32_t>(conf["accept_wait"].to<int32_t>(6000), 0);
+    size_t threads = conf["threads"].to<size_t>(4);
+    ppool_.reset(new Pool(conf["queue"].to<size_t>(1024), conf["hold"].to<int32_t>(10000)));
+    if (ppool_->Initialize(threads)) {
+        if (threads == 0) {
+            Logger::Info("auth : authorize on the handshake thread");
+        } else {
+            Logger::Info(boost::format("auth : %d authorization worker(s), wait %d msec") % threads % wait_);
+        }
+        return true;
+    }
+    ppool_.reset();
+    return false;
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+void Auth::Term() {
+    ppool_.reset();
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+int32_t Auth::Wait() {
+    return wait_;
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+int32_t Auth::AcceptWait() {
+    return acceptWait_;
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+std::string Auth::GetStatistics(const std::string& sep) {
+    return ppool_ ? ppool_->GetStatistics(sep) : std::string();
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+CURLcode Auth::Decide(const std::string& key, const perform_t& perform, const hold_t& hold, Json& body, int32_t wait) {
+    if (!ppool_) return perform(body);
+    return ppool_->Decide(key, perform, hold, body, wait);
+}
@@ -0,0 +1,28 @@
+﻿#pragma once
+
+#include "json.h"
+
+//----------------------------------------------------------------------------
+/// @class Auth
+/// worker pool which resolves webhook authorizations away from the srt handshake thread
+//----------------------------------------------------------------------------
+class Auth
+{
+    class Pool;
+    typedef boost::scoped_ptr<Pool> ppool_t;
+    static ppool_t ppool_;
+    static int32_t wait_;
+    static int32_t acceptWait_;
+public:
+    typedef std::function<CURLcode(Json& body)> perform_t; // called on a worker with the request body, returns the response body
+    typedef std::function<int32_t(CURLcode res)> hold_t;    // msec to reuse a decision of res (capped by "hold"; "hold" for deferred callers)
+    static bool Init(const Json::Node& conf);
+    static void Term();
+    static int32_t Wait(); // msec to wait for a decision during the handshake
+    static int32_t AcceptWait(); // msec to wait for a decision on the listening thread; rejected after that
+    static std::string GetStatistics(const std::string& sep = ", ");
+    // the same key shares one decision (and one webhook call) while it is pending and for min("hold", hold(res)) msec after it is decided,
+    // or for "hold" msec if a caller was deferred so that its retry is answered at once
+    // returns CURLE_AGAIN if the decision is not made within "wait" msec (-1:until decided)
+    static CURLcode Decide(const std::string& key, const perform_t& perform, const hold_t& hold, Json& body, int32_t wait);
+};
@@ -1,5 +1,6 @@
 ﻿#include "stdafx.h"
 #include "curl.h"
+#include "URI.h"
 
 #if defined(WIN32) || defined(WIN64)
 #include <MSTcpIp.h> // tcp_keepalive
@@ -71,6 +72,7 @@ long CurlGlobal::GetDefaultTimeout() {
 //----------------------------------------------------------------------------
 Curl::Curl(int keepalive, int keepidle, int keepintvl)
     : curl_(curl_easy_init(), curl_easy_cleanup)
+    , share_()
     , keepalive_(keepalive)
     , keepidle_(keepidle)
     , keepintvl_(keepintvl)
@@ -81,6 +83,7 @@ Curl::Curl(int keepalive, int keepidle, int keepintvl)
 //----------------------------------------------------------------------------
 Curl::Curl(const Curl& rhs)
     : curl_(rhs.curl_)
+    , share_(rhs.share_)
     , keepalive_(rhs.keepalive_)
     , keepidle_(rhs.keepidle_)
     , keepintvl_(rhs.keepintvl_)
@@ -101,6 +104,7 @@ Curl::~Curl() {
 Curl&  Curl::operator=(const Curl& rhs) {
     if (&rhs != this) {
         curl_ = rhs.curl_;
+        share_ = rhs.share_;
         keepalive_ = rhs.keepalive_;
         keepidle_ = rhs.keepidle_;
         keepintvl_ = rhs.keepintvl_;
@@ -117,6 +121,17 @@ void    Curl::Reset() {
         curl_easy_setopt(curl_.get(), CURLOPT_SOCKOPTFUNCTION, CallbackSockOptWrapper);
         curl_easy_setopt(curl_.get(), CURLOPT_SOCKOPTDATA, this);
     }
+    if (share_) {
+        curl_easy_setopt(curl_.get(), CURLOPT_SHARE, share_.get());
+    }
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+void    Curl::SetShare(const boost::shared_ptr<CURLSH>& share) {
+    share_ = share;
+    curl_easy_setopt(curl_.get(), CURLOPT_SHARE, share_.get());
 }
 
 //----------------------------------------------------------------------------
@@ -163,6 +178,168 @@ int     Curl::CallbackSockOpt(curl_socket_t curlfd, curlsocktype purpose) const
     return 0;
 }
 
+//----------------------------------------------------------------------------
+/// @class CurlPool::Origin
+/// idle handles and the share handle for one scheme://host:port
+//----------------------------------------------------------------------------
+class CurlPool::Origin : private boost::noncopyable
+{
+    typedef std::list<std::pair<Curl, boost::chrono::steady_clock::time_point> > idle_t;
+    boost::mutex mutex_;
+    boost::mutex locks_[CURL_LOCK_DATA_LAST];
+    boost::shared_ptr<CURLSH> share_;
+    idle_t idle_; // most recently used first
+public:
+    Origin() : mutex_(), share_(), idle_() {
+        CURLSH* share = curl_share_init();
+        if (!share) return;
+        curl_share_setopt(share, CURLSHOPT_LOCKFUNC, LockWrapper);
+        curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, UnlockWrapper);
+        curl_share_setopt(share, CURLSHOPT_USERDATA, this);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+        curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+        share_.reset(share, curl_share_cleanup);
+    }
+    ~Origin() {
+        idle_.clear(); // handles before the share handle
+    }
+    Curl Get(long idle) {
+        boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now();
+        boost::mutex::scoped_lock lock(mutex_);
+        while (!idle_.empty() && now - idle_.back().second > boost::chrono::seconds(idle)) {
+            idle_.pop_back();
+        }
+        if (!idle_.empty()) {
+            Curl curl = idle_.front().first;
+            idle_.pop_front();
+            return curl;
+        }
+        lock.unlock();
+        Curl curl;
+        if (share_) curl.SetShare(share_);
+        return curl;
+    }
+    void Put(const Curl& curl, size_t size) {
+        boost::mutex::scoped_lock lock(mutex_);
+        idle_.push_front(std::make_pair(curl, boost::chrono::steady_clock::now()));
+        while (idle_.size() > size) idle_.pop_back();
+    }
+protected:
+    static void LockWrapper(CURL* handle, curl_lock_data data, curl_lock_access access, void* userptr) {
+        static_cast<Origin*>(userptr)->locks_[data].lock();
+    }
+    static void UnlockWrapper(CURL* handle, curl_lock_data data, void* userptr) {
+        static_cast<Origin*>(userptr)->locks_[data].unlock();
+    }
+};
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+CurlPool::mutex_t CurlPool::mutex_;
+CurlPool::origins_t CurlPool::origins_;
+size_t CurlPool::size_ = 0;
+long CurlPool::idle_ = 60;
+boost::atomic<uint64_t> CurlPool::latencies_[CurlPool::LATENCY_BUCKETS];
+boost::atomic<uint64_t> CurlPool::requests_(0);
+boost::atomic<uint64_t> CurlPool::connects_(0);
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+void    CurlPool::SetPoolSize(size_t size, long idle) {
+    lock_t lk(mutex_);
+    size_ = size;
+    idle_ = idle;
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+void    CurlPool::Clear() {
+    lock_t lk(mutex_);
+    origins_.clear();
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+CurlPool::porigin_t CurlPool::GetOrigin(const std::string& uri) {
+    URI u(uri);
+    std::string key = (boost::format("%s://%s:%s") % boost::algorithm::to_lower_copy(u.scheme) % boost::algorithm::to_lower_copy(u.host) % u.port).str();
+    lock_t lk(mutex_);
+    porigin_t& origin = origins_[key];
+    if (!origin) origin.reset(new Origin());
+    return origin;
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+std::string CurlPool::GetStatistics(const std::string& sep) {
+    static const char* names[LATENCY_BUCKETS] = { "1ms", "4ms", "16ms", "64ms", "256ms", "1s", "4s", "Over" };
+    std::stringstream ss;
+    ss << "webhookRequests:" << requests_ << sep; // number of webhook calls
+    ss << "webhookConnects:" << connects_;       // number of new connections made for them
+    for (size_t i = 0; i < LATENCY_BUCKETS; ++i) {
+        ss << sep << "webhook" << names[i] << ":" << latencies_[i]; // number of webhook calls completed within the time
+    }
+    return ss.str();
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+CurlPool::Lease::Lease(const std::string& uri)
+    : origin_()
+    , curl_()
+    , start_(boost::chrono::steady_clock::now())
+    , reuse_(false)
+{
+    size_t size = 0;
+    long idle = 0;
+    {
+        lock_t lk(mutex_);
+        size = size_;
+        idle = idle_;
+    }
+    if (size == 0) return; // a fresh handle for every request
+    origin_ = GetOrigin(uri);
+    curl_ = origin_->Get(idle);
+    reuse_ = true;
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+CurlPool::Lease::~Lease() {
+    if (origin_ && reuse_) {
+        curl_.Reset();
+        lock_t lk(mutex_);
+        size_t size = size_;
+        lk.unlock();
+        origin_->Put(curl_, size);
+    }
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+void    CurlPool::Lease::Done(CURLcode res) {
+    uint64_t ms = static_cast<uint64_t>(boost::chrono::duration_cast<boost::chrono::milliseconds>(boost::chrono::steady_clock::now() - start_).count());
+    size_t bucket = 0;
+    for (uint64_t limit = 1; bucket + 1 < LATENCY_BUCKETS && ms > limit; limit *= 4) ++bucket;
+    ++latencies_[bucket];
+    ++requests_;
+    long connects = 0;
+    if (curl_easy_getinfo(curl_, CURLINFO_NUM_CONNECTS, &connects) == CURLE_OK) connects_ += connects;
+    // keep the handle unless the connection itself failed
+    if (res != CURLE_OK && res != CURLE_HTTP_RETURNED_ERROR) reuse_ = false;
+}
+
 //----------------------------------------------------------------------------
 //
 //----------------------------------------------------------------------------
@@ -26,6 +26,7 @@ public:
 class Curl
 {
     boost::shared_ptr<CURL> curl_;
+    boost::shared_ptr<CURLSH> share_;
     int keepalive_;
     int keepidle_;
     int keepintvl_;
@@ -35,6 +36,7 @@ public:
     virtual ~Curl();
     virtual Curl& operator=(const Curl& rhs);
     virtual void Reset();
+    virtual void SetShare(const boost::shared_ptr<CURLSH>& share); // kept across Reset()
     virtual CURLcode Perform() { return curl_easy_perform(curl_.get()); }
     virtual operator CURL*() { return curl_.get(); }
 protected:
@@ -42,6 +44,47 @@ protected:
     virtual int CallbackSockOpt(curl_socket_t curlfd, curlsocktype purpose) const;
 };
 
+//----------------------------------------------------------------------------
+/// @class CurlPool
+/// reusable easy handles per origin which keep connections, DNS and TLS sessions between requests
+//----------------------------------------------------------------------------
+class CurlPool
+{
+    class Origin;
+    typedef boost::shared_ptr<Origin> porigin_t;
+    typedef std::map<std::string, porigin_t> origins_t;
+    typedef boost::mutex mutex_t;
+    typedef boost::mutex::scoped_lock lock_t;
+    static mutex_t mutex_;
+    static origins_t origins_;
+    static size_t size_;                          // idle handles kept per origin (0:no reuse)
+    static long idle_;                            // sec to keep an idle handle
+    static const size_t LATENCY_BUCKETS = 8;      // 1ms, 4ms, 16ms, 64ms, 256ms, 1s, 4s and more
+    static boost::atomic<uint64_t> latencies_[LATENCY_BUCKETS];
+    static boost::atomic<uint64_t> requests_;
+    static boost::atomic<uint64_t> connects_;
+    static porigin_t GetOrigin(const std::string& uri);
+public:
+    //------------------------------------------------------------------------
+    /// @class CurlPool::Lease
+    /// a handle taken from the pool and given back on destruction
+    //------------------------------------------------------------------------
+    class Lease : private boost::noncopyable {
+        porigin_t origin_;
+        Curl curl_;
+        boost::chrono::steady_clock::time_point start_;
+        bool reuse_;
+    public:
+        Lease(const std::string& uri);
+        virtual ~Lease();
+        virtual operator Curl() const { return curl_; }
+        virtual void Done(CURLcode res); // call after perform to measure it; failed transfers do not return the handle
+    };
+    static void SetPoolSize(size_t size, long idle);
+    static void Clear();
+    static std::string GetStatistics(const std::string& sep = ", ");
+};
+
 //----------------------------------------------------------------------------
 /// @class CurlStrList
 //----------------------------------------------------------------------------
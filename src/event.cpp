@@ -4,27 +4,70 @@
 //----------------------------------------------------------------------------
 //
 //----------------------------------------------------------------------------
-void Event::AddEvent(boost::mutex& mutex, list_t& list, pair_t pair) {
-    boost::mutex::scoped_lock lk(mutex);
-    list.insert(std::lower_bound(list.begin(), list.end(), pair, [](const pair_t& lhs, const pair_t& rhs) {
-        return !(lhs.first - rhs.first < 0); // sort descending by priority
-    }), pair);
+Event::Set::Set() : mutex_(), snapshot_(new entries_t()), version_(0) {
 }
 
 //----------------------------------------------------------------------------
 //
 //----------------------------------------------------------------------------
-Event::vector_t Event::GetEvents(boost::mutex& mutex, list_t& list) {
-    boost::mutex::scoped_lock lk(mutex);
-    vector_t vector;
-    for (list_t::iterator it = list.begin(); it != list.end(); ) {
-        ptr_t ptr = it->second.lock();
-        if (ptr) {
-            vector.push_back(ptr);
-            ++it;
-        } else {
-            it = list.erase(it);
-        }
+void Event::Set::Add(wptr_t wptr, int priority, bool own) {
+    ptr_t ptr = wptr.lock();
+    if (!ptr) return;
+    Entry entry = { wptr, own ? ptr : ptr_t(), priority, own };
+    boost::mutex::scoped_lock lk(mutex_);
+    boost::shared_ptr<entries_t> entries(new entries_t());
+    entries->reserve(snapshot_->size() + 1);
+    std::remove_copy_if(snapshot_->begin(), snapshot_->end(), std::back_inserter(*entries), [](const Entry& e) {
+        return e.wptr.expired(); // drops the subscribers gone since the last change
+    });
+    entries->insert(std::upper_bound(entries->begin(), entries->end(), entry, [](const Entry& lhs, const Entry& rhs) {
+        return lhs.priority > rhs.priority; // sort descending by priority
+    }), entry);
+    snapshot_ = entries;
+    version_.fetch_add(1, boost::memory_order_release);
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+bool Event::Set::Remove(const ptr_t& ptr) {
+    boost::mutex::scoped_lock lk(mutex_);
+    entries_t::const_iterator it = std::find_if(snapshot_->begin(), snapshot_->end(), [&ptr](const Entry& entry) {
+        return entry.hold ? entry.hold == ptr : entry.wptr.lock() == ptr;
+    });
+    if (it == snapshot_->end()) return false;
+    boost::shared_ptr<entries_t> entries(new entries_t());
+    entries->reserve(snapshot_->size() - 1);
+    for (entries_t::const_iterator e = snapshot_->begin(); e != snapshot_->end(); ++e) {
+        if (e != it && !e->wptr.expired()) entries->push_back(*e);
     }
-    return vector;
+    snapshot_ = entries;
+    version_.fetch_add(1, boost::memory_order_release);
+    return true;
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+void Event::Set::Clear() {
+    boost::mutex::scoped_lock lk(mutex_);
+    snapshot_.reset(new entries_t());
+    version_.fetch_add(1, boost::memory_order_release);
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+Event::Set::snapshot_t Event::Set::Get() const {
+    boost::mutex::scoped_lock lk(mutex_);
+    return snapshot_;
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+void Event::Set::Reader::Reload() {
+    boost::mutex::scoped_lock lk(set_.mutex_);
+    snapshot_ = set_.snapshot_;
+    version_ = set_.version_.load(boost::memory_order_relaxed);
 }
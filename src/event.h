@@ -2,6 +2,7 @@
 
 #include "sockaddr.h"
 #include "option.h"
+#include "packet.h"
 
 //----------------------------------------------------------------------------
 /// @class Event
@@ -15,14 +16,56 @@ public:
     typedef boost::shared_ptr<Event> ptr_t;
     typedef boost::weak_ptr<Event> wptr_t;
     typedef std::vector<ptr_t> vector_t;
-    typedef std::pair<int, wptr_t> pair_t;
-    typedef std::list<pair_t> list_t;
     typedef std::vector<char> buf_t;
 
-    // for internal use
-    static void AddEvent(boost::mutex& mutex, list_t& list, wptr_t wptr, int priority = 0) { AddEvent(mutex, list, std::make_pair(priority, wptr)); }
-    static void AddEvent(boost::mutex& mutex, list_t& list, pair_t pair);
-    static vector_t GetEvents(boost::mutex& mutex, list_t& list);
+    //------------------------------------------------------------------------
+    /// @class Event::Set
+    /// subscribers of a listener or receiver (for internal use)
+    /// the entries are copied on every change so that a Reader only has to
+    /// compare the version while nothing has been added or removed;
+    /// only owned subscribers are kept alive by the set
+    //------------------------------------------------------------------------
+    class Set : private boost::noncopyable {
+    public:
+        struct Entry {
+            wptr_t wptr;
+            ptr_t hold; // owned subscribers only
+            int priority;
+            bool own;   // removed when the callback returns false
+            Event* get(ptr_t& locked) const {
+                // owned subscribers are pinned by the snapshot and used without touching the reference count;
+                // the others are locked into locked (null:gone)
+                if (hold) return hold.get();
+                locked = wptr.lock();
+                return locked.get();
+            }
+        };
+        typedef std::vector<Entry> entries_t;
+        typedef boost::shared_ptr<const entries_t> snapshot_t;
+        class Reader : private boost::noncopyable {
+            const Set& set_;
+            uint64_t version_;
+            snapshot_t snapshot_;
+        public:
+            explicit Reader(const Set& set) : set_(set), version_(0), snapshot_() {}
+            const entries_t& operator()() {
+                if (!snapshot_ || set_.version_.load(boost::memory_order_acquire) != version_) Reload();
+                return *snapshot_;
+            }
+            void Reset() { snapshot_.reset(); }
+        protected:
+            void Reload();
+        };
+        Set();
+        void Add(wptr_t wptr, int priority, bool own);
+        bool Remove(const ptr_t& ptr);
+        void Clear();
+        snapshot_t Get() const;
+    private:
+        mutable boost::mutex mutex_;
+        snapshot_t snapshot_;
+        boost::atomic<uint64_t> version_;
+    };
 
     Event() : listenerFlag_(false), receiverFlag_(false) {}
     virtual ~Event() {}
@@ -33,13 +76,14 @@ public:
     virtual bool OnThreadExit(const ListenOption& option) { return false; }
     virtual bool OnListenerFlag(const ListenOption& option) { return false; }
     virtual bool GetListenerFlag() const { return listenerFlag_; }
-    virtual void SetListenerFlag(bool flag) { listenerFlag_ = flag; }
+    virtual void SetListenerFlag(bool flag) { listenerFlag_ = flag; } // handled on the next connection; not polled
 
     // Receiver events to be overridden
-    virtual bool OnReceive(const ReceiveOption& option, const buf_t& buf, bool discrete) { return false; }
+    virtual bool OnReceive(const ReceiveOption& option, const Packet::ptr_t& pkt, bool discrete) { return false; }
+    virtual bool OnCache(const ReceiveOption& option, const Packet::vector_t& cache) { return false; } // before the first OnReceive
     virtual bool OnDisconnected(const ReceiveOption& option) { return false; }
     virtual bool OnThreadExit(const ReceiveOption& option) { return false; }
     virtual bool OnReceiverFlag(const ReceiveOption& option) { return false; }
     virtual bool GetReceiverFlag() const { return receiverFlag_; }
-    virtual void SetReceiverFlag(bool flag) { receiverFlag_ = flag; }
+    virtual void SetReceiverFlag(bool flag) { receiverFlag_ = flag; } // handled on the next message; not polled
 };
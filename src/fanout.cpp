@@ -0,0 +1,545 @@
+﻿#include "stdafx.h"
+#include "fanout.h"
+#include "logger.h"
+#include "affinity.h"
+
+//----------------------------------------------------------------------------
+/// @class Fanout::Pool
+//----------------------------------------------------------------------------
+class Fanout::Pool : private boost::noncopyable
+{
+    typedef std::deque<Queue::ptr_t> ready_t;
+    const size_t batch_;
+    ready_t ready_;
+    boost::thread_group threads_;
+    boost::mutex mutex_;
+    boost::condition_variable cond_;
+    size_t size_;
+public:
+    Pool(size_t batch) : batch_(batch), ready_(), threads_(), mutex_(), cond_(), size_(0) {
+    }
+    virtual ~Pool() {
+        Destroy();
+    }
+    virtual bool Initialize(size_t threads) {
+        for (size_t i = 0; i < threads; ++i) {
+            threads_.create_thread([this]() { Thread(); });
+        }
+        size_ = threads;
+        return true;
+    }
+    virtual void Destroy() {
+        threads_.interrupt_all();
+        cond_.notify_all();
+        threads_.join_all();
+        boost::mutex::scoped_lock lock(mutex_);
+        ready_.clear();
+        size_ = 0;
+    }
+    virtual size_t Size() const {
+        return size_;
+    }
+    virtual void Push(Queue::ptr_t queue) {
+        boost::mutex::scoped_lock lock(mutex_);
+        ready_.push_back(queue);
+        cond_.notify_one();
+    }
+protected:
+    virtual Queue::ptr_t Pop() {
+        boost::mutex::scoped_lock lock(mutex_);
+        cond_.wait(lock, [this]() {
+            if (!ready_.empty()) return true;
+            boost::this_thread::interruption_point();
+            return false;
+        });
+        Queue::ptr_t queue = ready_.front();
+        ready_.pop_front();
+        return queue;
+    }
+    virtual void Thread() {
+        Affinity::Apply(Affinity::PLAYBACK);
+        try {
+            for (;;) {
+                Queue::ptr_t queue = Pop();
+                // send a limited batch per turn so that one busy player cannot starve the others
+                if (queue->Drain(batch_)) Push(queue);
+            }
+        } catch (boost::thread_interrupted&) {
+        } catch (std::exception& ex) {
+            Logger::Error(boost::format("fanout : an unexpected exception occurred: %s") % ex.what());
+        }
+    }
+};
+
+//----------------------------------------------------------------------------
+/// @class Fanout::Waker
+/// one srt epoll thread which resumes the queues blocked by a full send buffer
+//----------------------------------------------------------------------------
+class Fanout::Waker : private boost::noncopyable
+{
+    typedef std::map<SRTSOCKET, boost::weak_ptr<Queue> > map_t;
+    int eid_;
+    map_t queues_;
+    boost::mutex mutex_;
+    boost::thread thread_;
+public:
+    Waker() : eid_(-1), queues_(), mutex_(), thread_() {
+    }
+    virtual ~Waker() {
+        Destroy();
+    }
+    virtual bool Initialize() {
+        eid_ = srt_epoll_create();
+        if (eid_ < 0) {
+            Logger::Error(boost::format("fanout : failed srt_epoll_create(): %s") % srt_getlasterror_str());
+            return false;
+        }
+        srt_epoll_set(eid_, SRT_EPOLL_ENABLE_EMPTY); // keep waiting while no queue is blocked
+        thread_ = boost::thread(&Waker::Thread, this);
+        return true;
+    }
+    virtual void Destroy() {
+        if (thread_.joinable()) {
+            thread_.interrupt();
+            thread_.join();
+        }
+        if (eid_ >= 0) {
+            srt_epoll_release(eid_);
+            eid_ = -1;
+        }
+        boost::mutex::scoped_lock lock(mutex_);
+        queues_.clear();
+    }
+    virtual bool Add(SRTSOCKET sfd, const Queue::ptr_t& queue) {
+        boost::mutex::scoped_lock lock(mutex_);
+        queues_[sfd] = queue;
+        int events = SRT_EPOLL_OUT | SRT_EPOLL_ERR;
+        if (srt_epoll_add_usock(eid_, sfd, &events) == SRT_ERROR) {
+            queues_.erase(sfd);
+            return false;
+        }
+        return true;
+    }
+    virtual void Remove(SRTSOCKET sfd) {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (queues_.erase(sfd) > 0) srt_epoll_remove_usock(eid_, sfd);
+    }
+protected:
+    virtual Queue::ptr_t Take(SRTSOCKET sfd) {
+        // level-triggered: a socket is waited for once per block
+        boost::mutex::scoped_lock lock(mutex_);
+        srt_epoll_remove_usock(eid_, sfd);
+        map_t::iterator it = queues_.find(sfd);
+        if (it == queues_.end()) return Queue::ptr_t();
+        Queue::ptr_t queue = it->second.lock();
+        queues_.erase(it);
+        return queue;
+    }
+    virtual void Thread() {
+        Affinity::Apply(Affinity::PLAYBACK);
+        std::vector<SRTSOCKET> srtwfds(256, SRT_INVALID_SOCK);
+        for (;;) {
+            try {
+                for (;; boost::this_thread::interruption_point()) {
+                    int srtwfdslen = static_cast<int>(srtwfds.size());
+                    int n = srt_epoll_wait(eid_, 0, 0, &srtwfds.at(0), &srtwfdslen, 100, 0, 0, 0, 0);
+                    for (int i = 0; i < n && i < srtwfdslen; ++i) {
+                        Queue::ptr_t queue = Take(srtwfds[i]);
+                        if (queue) Schedule(queue); // a broken socket fails on the next send
+                    }
+                }
+            } catch (boost::thread_interrupted&) {
+                return;
+            } catch (std::exception& ex) {
+                Logger::Error(boost::format("fanout : an unexpected exception occurred: %s") % ex.what());
+            }
+        }
+    }
+};
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+Fanout::ppool_t Fanout::ppool_;
+Fanout::pwaker_t Fanout::pwaker_;
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+boost::atomic<uint64_t> Fanout::decisions_[Fanout::POLICIES];
+boost::atomic<uint64_t> Fanout::dropped_(0);
+bool Fanout::residency_ = false;
+boost::atomic<uint64_t> Fanout::residencies_[Fanout::RESIDENCY_BUCKETS];
+boost::atomic<uint64_t> Fanout::residencyMax_(0);
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+static const char* s_policies[] = { "drop-new", "drop-old", "keyframe", "disconnect", nullptr };
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+Fanout::policy_t Fanout::Policy(const std::string& name) {
+    for (int i = 0; s_policies[i]; ++i) {
+        if (boost::iequals(name, s_policies[i])) return static_cast<policy_t>(i);
+    }
+    return DROP_NEW;
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+Fanout::Queue::Queue(const URIOption& option, const std::string& label, const send_t& send, int sfd)
+    : send_(send), sfd_(sfd), label_(label),
+    limit_(option.Get<size_t>("queue", 1024)), maxBytes_(option.Get<size_t>("queuebytes", 0)), maxDelay_(option.Get<int>("maxdelay", 0)), policy_(Policy(option.Get<std::string>("policy", "drop-new"))),
+    queue_(), bytes_(0), waitKey_(false), primed_(0), burst_(0), burstRate_(option.Get<uint64_t>("burst", 0) * 1000 / 8), burstSent_(0), burstStart_(), mutex_(), send_mutex_(), scheduled_(false), closed_(false), failed_(false), dropped_(0), decisions_(0), logged_() {
+    queue_.set_capacity(limit_ > 0 ? limit_ : 1024);
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+Fanout::Queue::~Queue() {
+    Close();
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+bool Fanout::Queue::Push(const Packet::ptr_t& pkt) {
+    if (failed_) return false;
+    boost::mutex::scoped_lock lock(mutex_);
+    if (closed_) return false;
+    if (pkt->Seq() <= primed_) return true; // already queued from the cache
+    if (waitKey_) {
+        if (!pkt->IsRandomAccess()) {
+            ++dropped_;
+            ++Fanout::dropped_;
+            return true;
+        }
+        waitKey_ = false;
+    }
+    if (Overflow(*pkt)) {
+        bool accepted = Apply(pkt);
+        ++decisions_;
+        ++Fanout::decisions_[policy_];
+        boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now();
+        if (policy_ == DISCONNECT || now - logged_ >= boost::chrono::seconds(1)) {
+            // log the first decision in every second
+            logged_ = now;
+            std::string msg = (boost::format("%s slow player : %s (queued:%d packet(s)/%d byte(s), decisions:%llu, dropped:%llu)")
+                % label_ % s_policies[policy_] % queue_.size() % bytes_ % decisions_ % dropped_).str();
+            lock.unlock();
+            Logger::Info(msg);
+            lock.lock();
+            if (closed_) return false;
+        }
+        if (failed_) return false;
+        if (!accepted) return true;
+    }
+    if (queue_.full()) {
+        queue_.set_capacity(queue_.capacity() * 2); // unlimited packets
+    }
+    queue_.push_back(pkt);
+    bytes_ += pkt->Size();
+    if (scheduled_) return true;
+    scheduled_ = true;
+    lock.unlock();
+    Schedule(shared_from_this());
+    return !failed_;
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+bool Fanout::Queue::Prime(const Packet::vector_t& cache) {
+    if (cache.empty()) return false;
+    size_t bytes = 0;
+    for (Packet::vector_t::const_iterator it = cache.begin(); it != cache.end(); ++it) {
+        bytes += (*it)->Size();
+    }
+    boost::mutex::scoped_lock lock(mutex_);
+    if (closed_ || failed_ || !queue_.empty()) return false;
+    if ((limit_ > 0 && cache.size() >= limit_) || (maxBytes_ > 0 && bytes >= maxBytes_)) {
+        return false; // the cache would overflow the queue by itself
+    }
+    if (queue_.capacity() < cache.size() * 2) {
+        queue_.set_capacity(std::max(queue_.capacity(), cache.size() * 2));
+    }
+    queue_.insert(queue_.end(), cache.begin(), cache.end());
+    bytes_ = bytes;
+    burst_ = cache.size();
+    burstSent_ = 0;
+    burstStart_ = boost::chrono::steady_clock::now();
+    primed_ = cache.back()->Seq();
+    scheduled_ = true;
+    lock.unlock();
+    Schedule(shared_from_this());
+    return true;
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+void Fanout::Queue::Close() {
+    {
+        boost::mutex::scoped_lock send_lock(send_mutex_); // wait for the running send
+        boost::mutex::scoped_lock lock(mutex_);
+        closed_ = true;
+        queue_.clear();
+        bytes_ = 0;
+        burst_ = 0;
+    }
+    Unwait(sfd_); // no longer waited once closed
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+size_t Fanout::Queue::Size() const {
+    boost::mutex::scoped_lock lock(mutex_);
+    return queue_.size();
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+size_t Fanout::Queue::Bytes() const {
+    boost::mutex::scoped_lock lock(mutex_);
+    return bytes_;
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+boost::chrono::milliseconds Fanout::Queue::Delay() const {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (queue_.empty()) return boost::chrono::milliseconds(0);
+    return boost::chrono::duration_cast<boost::chrono::milliseconds>(boost::chrono::steady_clock::now() - queue_.front()->Tick());
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+bool Fanout::Queue::Drain(size_t max) {
+    boost::mutex::scoped_lock send_lock(send_mutex_);
+    Packet::ptr_t pkt;
+    for (size_t n = 0; ; ++n) {
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            if (closed_ || queue_.empty()) {
+                scheduled_ = false;
+                return false;
+            }
+            if (max > 0 && n >= max) {
+                return true; // keep scheduled_ for the next turn
+            }
+            pkt = queue_.front(); // stays queued until sent, so that the backlog includes it
+            if (burst_ > 0 && !Paced(*pkt)) {
+                scheduled_ = false; // the next push retries
+                return false;
+            }
+        }
+        int ret = send_(*pkt);
+        boost::mutex::scoped_lock lock(mutex_);
+        if (ret == SEND_FAILED) {
+            failed_ = true;
+            queue_.clear();
+            bytes_ = 0;
+            burst_ = 0;
+            scheduled_ = false;
+            return false;
+        }
+        if (ret == SEND_BLOCKED) {
+            // stays scheduled until SRT_EPOLL_OUT, while the slow player policy applies to the pushes meanwhile
+            if (!closed_ && Wait(shared_from_this())) return false;
+            scheduled_ = false; // the next push retries
+            return false;
+        }
+        if (!queue_.empty() && queue_.front() == pkt) PopFront(); // unless dropped by a policy meanwhile
+        if (residency_) Measure(*pkt);
+    }
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+bool Fanout::Queue::Overflow(const Packet& pkt) const {
+    if (limit_ > 0 && queue_.size() >= limit_) return true;
+    if (maxBytes_ > 0 && bytes_ + pkt.Size() > maxBytes_) return true;
+    if (maxDelay_.count() > 0 && burst_ == 0 && !queue_.empty() && pkt.Tick() - queue_.front()->Tick() > maxDelay_) return true;
+    return false;
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+void Fanout::Queue::PopFront() {
+    bytes_ -= queue_.front()->Size();
+    queue_.pop_front();
+    if (burst_ > 0) --burst_;
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+bool Fanout::Queue::Paced(const Packet& pkt) {
+    if (burstRate_ == 0) return true;
+    uint64_t us = static_cast<uint64_t>(boost::chrono::duration_cast<boost::chrono::microseconds>(boost::chrono::steady_clock::now() - burstStart_).count());
+    if (burstSent_ > burstRate_ * us / 1000000) return false;
+    burstSent_ += pkt.Size();
+    return true;
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+bool Fanout::Queue::Apply(const Packet::ptr_t& pkt) {
+    size_t size = queue_.size();
+    switch (policy_) {
+    case DISCONNECT:
+        failed_ = true;
+        queue_.clear();
+        bytes_ = 0;
+        burst_ = 0;
+        return false;
+    case KEYFRAME:
+        if (pkt->IsRandomAccess()) {
+            queue_.clear();
+            bytes_ = 0;
+            burst_ = 0;
+        } else {
+            queue_t::reverse_iterator it = std::find_if(queue_.rbegin(), queue_.rend(), [](const Packet::ptr_t& p) {
+                return p->IsRandomAccess();
+            });
+            if (it == queue_.rend()) {
+                // no random access point left: resume at the next one
+                queue_.clear();
+                bytes_ = 0;
+                burst_ = 0;
+                waitKey_ = true;
+                dropped_ += size + 1;
+                Fanout::dropped_ += size + 1;
+                return false;
+            }
+            Packet::ptr_t key = *it;
+            while (queue_.front() != key) PopFront();
+        }
+        // fall back to dropping the oldest if a single GOP exceeds the limit
+    case DROP_OLD:
+        while (!queue_.empty() && Overflow(*pkt)) PopFront();
+        dropped_ += size - queue_.size();
+        Fanout::dropped_ += size - queue_.size();
+        return true;
+    default:
+        ++dropped_;
+        ++Fanout::dropped_;
+        return false;
+    }
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+bool Fanout::Init(const Json::Node& conf) {
+    if (ppool_) return true;
+    residency_ = conf["residency"].to<int>(0) > 0;
+    size_t threads = conf["threads"].to<size_t>(std::max<size_t>(boost::thread::hardware_concurrency(), 1));
+    pwaker_.reset(new Waker());
+    if (!pwaker_->Initialize()) {
+        pwaker_.reset();
+        return false;
+    }
+    if (threads == 0) {
+        Logger::Info("fanout : send on the receive thread");
+        return true;
+    }
+    ppool_.reset(new Pool(std::max<size_t>(conf["batch"].to<size_t>(32), 1)));
+    if (ppool_->Initialize(threads)) {
+        Logger::Info(boost::format("fanout : %d sender worker(s)") % threads);
+        return true;
+    }
+    ppool_.reset();
+    return false;
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+void Fanout::Term() {
+    pwaker_.reset(); // schedules into the pool
+    ppool_.reset();
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+size_t Fanout::Threads() {
+    return ppool_ ? ppool_->Size() : 0;
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+Fanout::Queue::ptr_t Fanout::CreateQueue(const URIOption& option, const std::string& label, const send_t& send, int sfd) {
+    return Queue::ptr_t(new Queue(option, label, send, sfd));
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+std::string Fanout::GetStatistics(const std::string& sep) {
+    std::stringstream ss;
+    ss << "queueDropped:" << dropped_ << sep;                  // number of packets dropped for slow players
+    ss << "queueDropNew:" << decisions_[DROP_NEW] << sep;      // number of "drop-new" decisions
+    ss << "queueDropOld:" << decisions_[DROP_OLD] << sep;      // number of "drop-old" decisions
+    ss << "queueKeyframe:" << decisions_[KEYFRAME] << sep;     // number of "keyframe" decisions
+    ss << "queueDisconnect:" << decisions_[DISCONNECT];        // number of players given up
+    if (residency_) {
+        static const char* names[RESIDENCY_BUCKETS] = { "64us", "256us", "1ms", "4ms", "16ms", "64ms", "256ms", "Over" };
+        for (size_t i = 0; i < RESIDENCY_BUCKETS; ++i) {
+            ss << sep << "residency" << names[i] << ":" << residencies_[i]; // number of packets sent within the time after received
+        }
+        ss << sep << "residencyMaxUs:" << residencyMax_;
+    }
+    return ss.str();
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+void Fanout::Measure(const Packet& pkt) {
+    uint64_t us = static_cast<uint64_t>(boost::chrono::duration_cast<boost::chrono::microseconds>(boost::chrono::steady_clock::now() - pkt.Tick()).count());
+    size_t bucket = 0;
+    for (uint64_t limit = 64; bucket + 1 < RESIDENCY_BUCKETS && us > limit; limit *= 4) ++bucket;
+    ++residencies_[bucket];
+    uint64_t max = residencyMax_.load(boost::memory_order_relaxed);
+    while (us > max && !residencyMax_.compare_exchange_weak(max, us, boost::memory_order_relaxed));
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+void Fanout::Schedule(Queue::ptr_t queue) {
+    if (ppool_) {
+        ppool_->Push(queue);
+        return;
+    }
+    // no workers: drain on the caller's thread
+    while (queue->Drain(0));
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+bool Fanout::Wait(Queue::ptr_t queue) {
+    return pwaker_ && queue->sfd_ >= 0 && pwaker_->Add(static_cast<SRTSOCKET>(queue->sfd_), queue);
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+void Fanout::Unwait(int sfd) {
+    if (pwaker_ && sfd >= 0) pwaker_->Remove(static_cast<SRTSOCKET>(sfd));
+}
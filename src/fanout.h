@@ -0,0 +1,96 @@
+﻿#pragma once
+
+#include "json.h"
+#include "event.h"
+
+//----------------------------------------------------------------------------
+/// @class Fanout
+/// per-subscriber bounded send queues drained by a shared pool of sender workers
+//----------------------------------------------------------------------------
+class Fanout
+{
+    class Pool;
+    typedef boost::scoped_ptr<Pool> ppool_t;
+    static ppool_t ppool_;
+    class Waker;
+    typedef boost::scoped_ptr<Waker> pwaker_t;
+    static pwaker_t pwaker_;
+    enum policy_t {
+        DROP_NEW,   // drop incoming packets while the backlog is over the limit
+        DROP_OLD,   // drop the oldest packets
+        KEYFRAME,   // skip to the latest random access point
+        DISCONNECT, // give up the player
+        POLICIES
+    };
+    static policy_t Policy(const std::string& name);
+    static boost::atomic<uint64_t> decisions_[POLICIES];
+    static boost::atomic<uint64_t> dropped_;
+    static const size_t RESIDENCY_BUCKETS = 8; // 64us, 256us, 1ms, 4ms, 16ms, 64ms, 256ms and more
+    static bool residency_;                    // measurement mode
+    static boost::atomic<uint64_t> residencies_[RESIDENCY_BUCKETS];
+    static boost::atomic<uint64_t> residencyMax_;
+    static void Measure(const Packet& pkt);
+public:
+    enum {
+        SEND_FAILED = -1,
+        SEND_BLOCKED = 0, // the packet is kept and retried when the socket becomes writable (or on the next push without a socket)
+        SEND_OK = 1
+    };
+    typedef std::function<int(const Packet& pkt)> send_t;
+    class Queue : public boost::enable_shared_from_this<Queue>, private boost::noncopyable {
+        friend class Fanout;
+        typedef boost::circular_buffer<Packet::ptr_t> queue_t;
+        send_t send_;
+        const int sfd_;                              // srt socket waited for SRT_EPOLL_OUT while blocked (-1:none)
+        const std::string label_;
+        const size_t limit_;                         // packets (0:unlimited)
+        const size_t maxBytes_;                      // bytes (0:unlimited)
+        const boost::chrono::milliseconds maxDelay_; // behind live (0:unlimited)
+        const policy_t policy_;
+        queue_t queue_;
+        size_t bytes_;
+        bool waitKey_;
+        uint64_t primed_;                            // Seq() of the last cached packet
+        size_t burst_;                               // cached packets still queued
+        const uint64_t burstRate_;                   // bytes per second (0:unlimited)
+        uint64_t burstSent_;
+        boost::chrono::steady_clock::time_point burstStart_;
+        mutable boost::mutex mutex_;
+        boost::mutex send_mutex_;
+        bool scheduled_;
+        bool closed_;
+        boost::atomic<bool> failed_;
+        boost::atomic<uint64_t> dropped_;
+        boost::atomic<uint64_t> decisions_;
+        boost::chrono::steady_clock::time_point logged_;
+    public:
+        typedef boost::shared_ptr<Queue> ptr_t;
+        Queue(const URIOption& option, const std::string& label, const send_t& send, int sfd);
+        virtual ~Queue();
+        virtual bool Push(const Packet::ptr_t& pkt); // false after the send handler has failed or the player is given up
+        virtual bool Prime(const Packet::vector_t& cache); // queue the GOP cache ahead of the live packets
+        virtual void Close();
+        virtual bool Failed() const { return failed_; }
+        virtual uint64_t Dropped() const { return dropped_; }
+        virtual uint64_t Decisions() const { return decisions_; }
+        virtual size_t Size() const;
+        virtual size_t Bytes() const;
+        virtual boost::chrono::milliseconds Delay() const; // age of the oldest queued packet
+    protected:
+        virtual bool Drain(size_t max); // true if the queue still has packets to send
+        virtual bool Overflow(const Packet& pkt) const;
+        virtual void PopFront();
+        virtual bool Apply(const Packet::ptr_t& pkt); // false if the incoming packet is dropped
+        virtual bool Paced(const Packet& pkt);        // false while the cache burst is ahead of its rate
+    };
+    static bool Init(const Json::Node& conf);
+    static void Term();
+    static size_t Threads();
+    static std::string GetStatistics(const std::string& sep = ", ");
+    // option: "queue" (packets), "queuebytes", "maxdelay" (msec), "policy" ("drop-new", "drop-old", "keyframe", "disconnect"), "burst" (kbps)
+    static Queue::ptr_t CreateQueue(const URIOption& option, const std::string& label, const send_t& send, int sfd = -1);
+protected:
+    static void Schedule(Queue::ptr_t queue);
+    static bool Wait(Queue::ptr_t queue); // schedules the queue again when its socket becomes writable
+    static void Unwait(int sfd);
+};
@@ -0,0 +1,141 @@
+﻿#include "stdafx.h"
+#include "janitor.h"
+#include "logger.h"
+#include "affinity.h"
+
+//----------------------------------------------------------------------------
+/// @class Janitor::Worker
+//----------------------------------------------------------------------------
+class Janitor::Worker : private boost::noncopyable
+{
+    const boost::chrono::microseconds interval_; // between tasks (0:unlimited)
+    std::deque<task_t> tasks_;
+    boost::thread thread_;
+    boost::mutex mutex_;
+    boost::condition_variable cond_;
+    boost::atomic<uint64_t> posted_;
+    boost::atomic<uint64_t> done_;
+public:
+    Worker(double rate)
+        : interval_(rate > 0 ? static_cast<int64_t>(1000000 / rate) : 0), tasks_(), thread_(), mutex_(), cond_(), posted_(0), done_(0) {
+    }
+    virtual ~Worker() {
+        Destroy();
+    }
+    virtual bool Initialize() {
+        thread_ = boost::thread(&Worker::Thread, this);
+        return true;
+    }
+    virtual void Destroy() {
+        if (thread_.joinable()) {
+            thread_.interrupt();
+            cond_.notify_all();
+            thread_.join();
+        }
+        for (;;) {
+            task_t task;
+            {
+                boost::mutex::scoped_lock lock(mutex_);
+                if (tasks_.empty()) break;
+                task = tasks_.front();
+                tasks_.pop_front();
+            }
+            Run(task);
+        }
+    }
+    virtual void Post(task_t task) {
+        ++posted_;
+        boost::mutex::scoped_lock lock(mutex_);
+        tasks_.push_back(std::move(task));
+        cond_.notify_one();
+    }
+    virtual std::string GetStatistics(const std::string& sep) {
+        size_t queued = 0;
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            queued = tasks_.size();
+        }
+        std::stringstream ss;
+        ss << "janitorPosted:" << posted_ << sep; // number of tasks posted
+        ss << "janitorDone:" << done_ << sep;     // number of tasks run
+        ss << "janitorQueued:" << queued;         // number of tasks waiting
+        return ss.str();
+    }
+protected:
+    virtual task_t Pop() {
+        boost::mutex::scoped_lock lock(mutex_);
+        cond_.wait(lock, [this]() {
+            if (!tasks_.empty()) return true;
+            boost::this_thread::interruption_point();
+            return false;
+        });
+        task_t task = std::move(tasks_.front());
+        tasks_.pop_front();
+        return task;
+    }
+    virtual void Run(task_t& task) {
+        try {
+            task();
+        } catch (std::exception& ex) {
+            Logger::Error(boost::format("janitor : an unexpected exception occurred: %s") % ex.what());
+        }
+        task = task_t(); // releases what the task holds on this thread
+        ++done_;
+    }
+    virtual void Thread() {
+        Affinity::Apply(Affinity::UPLOADER);
+        try {
+            for (;;) {
+                task_t task = Pop();
+                Run(task);
+                if (interval_.count() > 0) boost::this_thread::sleep_for(interval_);
+            }
+        } catch (boost::thread_interrupted&) {
+        }
+    }
+};
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+Janitor::pworker_t Janitor::pworker_;
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+bool Janitor::Init(const Json::Node& conf) {
+    if (pworker_) return true;
+    double rate = conf["rate"].to<double>(10);
+    pworker_.reset(new Worker(rate));
+    if (pworker_->Initialize()) {
+        Logger::Info(boost::format("janitor : %s task(s) per sec") % (rate > 0 ? boost::lexical_cast<std::string>(rate) : std::string("unlimited")));
+        return true;
+    }
+    pworker_.reset();
+    return false;
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+void Janitor::Term() {
+    pworker_.reset();
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+void Janitor::Post(task_t task) {
+    if (pworker_) {
+        pworker_->Post(std::move(task));
+    } else {
+        task();
+    }
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+std::string Janitor::GetStatistics(const std::string& sep) {
+    return pworker_ ? pworker_->GetStatistics(sep) : std::string();
+}
@@ -0,0 +1,20 @@
+﻿#pragma once
+
+#include "json.h"
+
+//----------------------------------------------------------------------------
+/// @class Janitor
+/// background thread which runs slow housekeeping (segment removal) at a limited rate
+//----------------------------------------------------------------------------
+class Janitor
+{
+    class Worker;
+    typedef boost::scoped_ptr<Worker> pworker_t;
+    static pworker_t pworker_;
+public:
+    typedef std::function<void()> task_t;
+    static bool Init(const Json::Node& conf);
+    static void Term(); // the remaining tasks are run before returning
+    static void Post(task_t task); // moved to the janitor; runs on the calling thread if the janitor is not running
+    static std::string GetStatistics(const std::string& sep = ", ");
+};
@@ -1,34 +1,221 @@
 ﻿#include "stdafx.h"
 #include "listener.h"
 #include "messages.h"
+#include "affinity.h"
+#include "timer.h"
+
+#if !defined(WIN32) && !defined(WIN64)
+#include <unistd.h> // close
+#endif
+
+//----------------------------------------------------------------------------
+/// @class Admission
+/// token buckets per source address and per prefix, and caps on handshakes and sessions
+//----------------------------------------------------------------------------
+class Admission : private boost::noncopyable
+{
+public:
+    enum verdict_t { ADMIT, SOURCE, PREFIX, HANDSHAKES, SESSIONS, VERDICTS };
+private:
+    struct Bucket {
+        double tokens;
+        boost::chrono::steady_clock::time_point last;
+    };
+    typedef std::unordered_map<std::string, Bucket> buckets_t;
+    typedef std::map<SRTSOCKET, boost::chrono::steady_clock::time_point> handshakes_t;
+    const double rate_;          // handshakes per second per source address (0:unlimited)
+    const double burst_;
+    const double prefixRate_;    // handshakes per second per prefix (0:unlimited)
+    const double prefixBurst_;
+    const int32_t prefix4_;      // prefix length of IPv4
+    const int32_t prefix6_;      // prefix length of IPv6
+    const size_t maxHandshakes_; // handshakes in progress (0:unlimited)
+    const size_t maxSessions_;   // connections accepted and still open (0:unlimited)
+    boost::mutex mutex_;
+    buckets_t sources_;
+    buckets_t prefixes_;
+    handshakes_t handshakes_;    // admitted until srt_accept() and the events are done with them
+    std::set<SRTSOCKET> sessions_;
+    Timer::id_t sweep_;
+    boost::atomic<uint64_t> verdicts_[VERDICTS];
+public:
+    Admission(const ListenOption& option)
+        : rate_(option.Get<double>("ratelimit", 0)), burst_(std::max(option.Get<double>("rateburst", 10), 1.0)),
+        prefixRate_(option.Get<double>("prefixlimit", 0)), prefixBurst_(std::max(option.Get<double>("prefixburst", 50), 1.0)),
+        prefix4_(option.Get<int32_t>("prefixlen4", 24)), prefix6_(option.Get<int32_t>("prefixlen6", 48)),
+        maxHandshakes_(option.Get<size_t>("maxhandshakes", 0)), maxSessions_(option.Get<size_t>("maxsessions", 0)),
+        mutex_(), sources_(), prefixes_(), handshakes_(), sessions_(), sweep_(0) {
+        for (size_t i = 0; i < VERDICTS; ++i) verdicts_[i] = 0;
+        sweep_ = Timer::Schedule(1000, [this]() { Sweep(); return 1000; });
+    }
+    ~Admission() {
+        Timer::Cancel(sweep_);
+    }
+    verdict_t Enter(SRTSOCKET sfd, const SockAddr& peer) {
+        // Leave() has to be called when ADMIT is returned
+        return Count(Check(sfd, peer));
+    }
+    void Leave(SRTSOCKET sfd, bool accepted) {
+        // the handshake is still counted until Accepted() when the listen callback lets it through
+        if (accepted) return;
+        boost::mutex::scoped_lock lock(mutex_);
+        handshakes_.erase(sfd);
+    }
+    void Accepted(SRTSOCKET sfd, bool accepted) {
+        // called on the listening thread after the events have taken or closed the socket from srt_accept()
+        boost::mutex::scoped_lock lock(mutex_);
+        handshakes_.erase(sfd);
+        if (accepted) sessions_.insert(sfd);
+    }
+    void Sweep() {
+        // called on the timer thread every second
+        boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now();
+        boost::chrono::steady_clock::time_point stale = now - boost::chrono::seconds(10);
+        boost::mutex::scoped_lock lock(mutex_);
+        for (handshakes_t::iterator it = handshakes_.begin(); it != handshakes_.end();) {
+            // closed before srt_accept() or never completed
+            if (srt_getsockstate(it->first) >= SRTS_BROKEN || it->second < stale) {
+                it = handshakes_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        for (std::set<SRTSOCKET>::iterator it = sessions_.begin(); it != sessions_.end();) {
+            if (srt_getsockstate(*it) >= SRTS_BROKEN) {
+                it = sessions_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        Sweep(sources_, rate_, burst_, now);
+        Sweep(prefixes_, prefixRate_, prefixBurst_, now);
+    }
+    std::string GetStatistics(const std::string& sep) {
+        size_t handshakes = 0, sessions = 0;
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            handshakes = handshakes_.size();
+            sessions = sessions_.size();
+        }
+        std::stringstream ss;
+        ss << "admitted:" << verdicts_[ADMIT] << sep;             // number of handshakes passed to the events
+        ss << "rejectedSource:" << verdicts_[SOURCE] << sep;      // number of handshakes over the rate of the source address
+        ss << "rejectedPrefix:" << verdicts_[PREFIX] << sep;      // number of handshakes over the rate of the prefix
+        ss << "rejectedHandshakes:" << verdicts_[HANDSHAKES] << sep; // number of handshakes over the concurrent handshakes
+        ss << "rejectedSessions:" << verdicts_[SESSIONS] << sep;  // number of handshakes over the sessions
+        ss << "handshakes:" << handshakes << sep;                 // number of handshakes admitted and not yet accepted
+        ss << "sessions:" << sessions;                            // number of sessions accepted and still open
+        return ss.str();
+    }
+protected:
+    verdict_t Count(verdict_t verdict) {
+        ++verdicts_[verdict];
+        return verdict;
+    }
+    verdict_t Check(SRTSOCKET sfd, const SockAddr& peer) {
+        std::string source, prefix;
+        if (peer.IsV4()) {
+            source.assign(reinterpret_cast<const char*>(&reinterpret_cast<const sockaddr_in*>(&peer)->sin_addr), 4);
+            prefix = Mask(source, prefix4_);
+        } else if (peer.IsV6()) {
+            source.assign(reinterpret_cast<const char*>(reinterpret_cast<const sockaddr_in6*>(&peer)->sin6_addr.s6_addr), 16);
+            prefix = Mask(source, prefix6_);
+        }
+        boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now();
+        boost::mutex::scoped_lock lock(mutex_);
+        if (maxHandshakes_ > 0 && handshakes_.size() >= maxHandshakes_) return HANDSHAKES;
+        if (maxSessions_ > 0 && sessions_.size() >= maxSessions_) return SESSIONS;
+        if (!Take(prefixes_, prefix, prefixRate_, prefixBurst_, now)) return PREFIX;
+        if (!Take(sources_, source, rate_, burst_, now)) return SOURCE;
+        handshakes_[sfd] = now;
+        return ADMIT;
+    }
+    static std::string Mask(const std::string& addr, int32_t len) {
+        std::string prefix(addr);
+        for (size_t i = 0; i < prefix.size(); ++i, len -= 8) {
+            if (len <= 0) {
+                prefix[i] = 0;
+            } else if (len < 8) {
+                prefix[i] = static_cast<char>(static_cast<uint8_t>(prefix[i]) & (0xffu << (8 - len)));
+            }
+        }
+        return prefix;
+    }
+    static bool Take(buckets_t& buckets, const std::string& key, double rate, double burst, const boost::chrono::steady_clock::time_point& now) {
+        if (rate <= 0) return true;
+        buckets_t::iterator it = buckets.find(key);
+        if (it == buckets.end()) {
+            Bucket bucket = { burst, now };
+            it = buckets.insert(std::make_pair(key, bucket)).first;
+        }
+        Bucket& bucket = it->second;
+        double elapsed = boost::chrono::duration_cast<boost::chrono::duration<double> >(now - bucket.last).count();
+        bucket.tokens = std::min(burst, bucket.tokens + elapsed * rate);
+        bucket.last = now;
+        if (bucket.tokens < 1.0) return false;
+        bucket.tokens -= 1.0;
+        return true;
+    }
+    static void Sweep(buckets_t& buckets, double rate, double burst, const boost::chrono::steady_clock::time_point& now) {
+        // a bucket refilled up to the burst is the same as no bucket
+        for (buckets_t::iterator it = buckets.begin(); it != buckets.end();) {
+            double elapsed = boost::chrono::duration_cast<boost::chrono::duration<double> >(now - it->second.last).count();
+            if (it->second.tokens + elapsed * rate >= burst) {
+                it = buckets.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+};
 
 //----------------------------------------------------------------------------
 /// @class Listener::Impl
 //----------------------------------------------------------------------------
 class Listener::Impl
 {
+    // listening sockets on the same port with their own udp socket, epoll and accept thread
+    struct Shard : private boost::noncopyable {
+        std::vector<SRTSOCKET> sfds;
+        int eid;
+        boost::thread thread;
+        Event::Set::Reader reader; // used only on the listening thread of the shard
+        Shard(const Event::Set& events) : sfds(), eid(-1), thread(), reader(events) {}
+    };
+    typedef boost::shared_ptr<Shard> pshard_t;
     Listener* owner_;
     const ListenOption option_;
-    std::vector<SRTSOCKET> sfds_;
-    int eid_;
-    boost::thread thread_;
+    std::vector<pshard_t> shards_;
+    size_t primary_; // the first shard which listens; handles the listener flags and the thread exit
     boost::mutex mutex_;
-    Event::list_t events_;
-    Event::vector_t own_events_;
+    Event::Set events_;
+    Admission admission_;
     SafeMessages errmsgs_;
 public:
     Impl(Listener* owner, const ListenOption& option)
-        : owner_(owner), option_(option), sfds_(), eid_(-1), thread_(), mutex_(), events_(), own_events_(), errmsgs_() {
+        : owner_(owner), option_(option), shards_(), primary_(0), mutex_(), events_(), admission_(option), errmsgs_() {
     }
     virtual ~Impl() {
         Destroy();
     }
     virtual bool Initialize() {
         Destroy();
-        eid_ = srt_epoll_create();
-        if (eid_ < 0) {
-            errmsgs_ << boost::format("failed srt_epoll_create(): %s") % srt_getlasterror_str();
-            return false;
+        size_t shards = std::max<size_t>(option_.Get<size_t>("shards", 1), 1);
+#if !defined(__linux__) || !defined(SO_REUSEPORT)
+        // only Linux distributes the datagrams over the sockets sharing the port
+        if (shards > 1) {
+            errmsgs_ << "\"shards\" is ignored because SO_REUSEPORT does not balance the load on this platform.";
+            shards = 1;
+        }
+#endif
+        for (size_t i = 0; i < shards; ++i) {
+            pshard_t shard(new Shard(events_));
+            shard->eid = srt_epoll_create();
+            if (shard->eid < 0) {
+                errmsgs_ << boost::format("failed srt_epoll_create(): %s") % srt_getlasterror_str();
+                return false;
+            }
+            shards_.push_back(shard);
         }
         std::string host = option_.Get<std::string>("host", "");
         std::string port = option_.Get<std::string>("port", "");
@@ -49,95 +236,147 @@ public:
             return false;
         }
         for (addrinfo* res = res0; res; res = res->ai_next) {
-            SRTSOCKET sfd = srt_create_socket();
-            if (sfd == SRT_INVALID_SOCK) {
-                errmsgs_ << boost::format("failed srt_create_socket(): %s") % srt_getlasterror_str();
-                continue;
-            }
-            if (res->ai_family == AF_INET6) {
+            for (std::vector<pshard_t>::const_iterator shard = shards_.begin(); shard != shards_.end(); ++shard) {
+                std::vector<SRTSOCKET>& sfds = (*shard)->sfds;
+                SRTSOCKET sfd = srt_create_socket();
+                if (sfd == SRT_INVALID_SOCK) {
+                    errmsgs_ << boost::format("failed srt_create_socket(): %s") % srt_getlasterror_str();
+                    continue;
+                }
                 int32_t ipv6Only = host.empty() ? 0 : 1;
-                if (srt_setsockflag(sfd, SRTO_IPV6ONLY, &ipv6Only, sizeof(ipv6Only)) == SRT_ERROR) {
-                    errmsgs_ << boost::format("failed srt_setsockflag(SRTO_IPV6ONLY) [ %d ]; %s") % ipv6Only % srt_getlasterror_str();
-                    return false;
+                if (res->ai_family == AF_INET6) {
+                    if (srt_setsockflag(sfd, SRTO_IPV6ONLY, &ipv6Only, sizeof(ipv6Only)) == SRT_ERROR) {
+                        errmsgs_ << boost::format("failed srt_setsockflag(SRTO_IPV6ONLY) [ %d ]; %s") % ipv6Only % srt_getlasterror_str();
+                        return false;
+                    }
+                } else if (host.empty() && (!sfds.empty() || res->ai_next)) {
+                    // ignore IPv4 because IPv4-mapped IPv6 would work
+                    srt_close(sfd);
+                    continue;
                 }
-            } else if (host.empty() && (!sfds_.empty() || res->ai_next)) {
-                // ignore IPv4 because IPv4-mapped IPv6 would work
-                srt_close(sfd);
-                continue;
-            }
-            if (!SetSockFlags(sfd, option_, errmsgs_)) {
-                srt_close(sfd);
-                continue;
-            }
-            if (srt_bind(sfd, res->ai_addr, static_cast<int>(res->ai_addrlen)) == SRT_ERROR) {
-                errmsgs_ << boost::format("failed srt_bind() [ %s ]; %s") % SockAddr(res->ai_addr, res->ai_addrlen).ToString() % srt_getlasterror_str();
-                srt_close(sfd);
-                continue;
-            }
-            if (srt_listen(sfd, option_.Get<int>("backlog", 10)) == SRT_ERROR) {
-                errmsgs_ << boost::format("failed srt_listen(); %s") % srt_getlasterror_str();
-                srt_close(sfd);
-                continue;
-            }
-            if (srt_listen_callback(sfd, ListenCallbackWrapper, this) == SRT_ERROR) {
-                errmsgs_ << boost::format("failed srt_listen_callback(); %s") % srt_getlasterror_str();
-                srt_close(sfd);
-                continue;
-            }
-            int events = SRT_EPOLL_IN | SRT_EPOLL_ERR;
-            if (srt_epoll_add_usock(eid_, sfd, &events) == SRT_ERROR) {
-                errmsgs_ << boost::format("failed srt_epoll_add_usock(); %s") % srt_getlasterror_str();
-                srt_close(sfd);
-                continue;
+                if (!SetSockFlags(sfd, option_, errmsgs_)) {
+                    srt_close(sfd);
+                    continue;
+                }
+                if (!Bind(sfd, res, shards_.size() > 1, ipv6Only)) {
+                    srt_close(sfd);
+                    continue;
+                }
+                if (srt_listen(sfd, option_.Get<int>("backlog", 10)) == SRT_ERROR) {
+                    errmsgs_ << boost::format("failed srt_listen(); %s") % srt_getlasterror_str();
+                    srt_close(sfd);
+                    continue;
+                }
+                if (srt_listen_callback(sfd, ListenCallbackWrapper, this) == SRT_ERROR) {
+                    errmsgs_ << boost::format("failed srt_listen_callback(); %s") % srt_getlasterror_str();
+                    srt_close(sfd);
+                    continue;
+                }
+                int events = SRT_EPOLL_IN | SRT_EPOLL_ERR;
+                if (srt_epoll_add_usock((*shard)->eid, sfd, &events) == SRT_ERROR) {
+                    errmsgs_ << boost::format("failed srt_epoll_add_usock(); %s") % srt_getlasterror_str();
+                    srt_close(sfd);
+                    continue;
+                }
+                //TRACE(_T("MESRT::Listener::Impl::Initialize (%s) Listen %s\n"), A4T(host).c_str(), A4T(SockAddr(res->ai_addr, res->ai_addrlen).ToString()).c_str());
+                sfds.push_back(sfd);
+                //break;
             }
-            //TRACE(_T("MESRT::Listener::Impl::Initialize (%s) Listen %s\n"), A4T(host).c_str(), A4T(SockAddr(res->ai_addr, res->ai_addrlen).ToString()).c_str());
-            sfds_.push_back(sfd);
-            //break;
         }
         freeaddrinfo(res0);
-        if (sfds_.empty()) {
+        bool listening = false;
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            if (shards_[i]->sfds.empty()) continue;
+            if (!listening) primary_ = i;
+            listening = true;
+        }
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            if (shards_[i]->sfds.empty()) continue;
+            shards_[i]->thread = boost::thread(&Impl::Thread, this, i);
+        }
+        if (!listening) {
             errmsgs_ << "there is no interface to start listening.";
             return false;
         }
-        thread_ = boost::thread(&Impl::Thread, this);
         return true;
     }
     virtual void Destroy() {
-        if (eid_ >= 0) {
-            int eid = eid_;
-            eid_ = -1;
-            srt_epoll_release(eid);
-        }
-        if (thread_.joinable()) {
-            thread_.join();
-            //TRACE(_T("MESRT::Listener::Impl::Destroy (%s)\n"), A4T(option_.Get<std::string>("host", "")).c_str());
+        for (std::vector<pshard_t>::const_iterator it = shards_.begin(); it != shards_.end(); ++it) {
+            if ((*it)->eid >= 0) {
+                int eid = (*it)->eid;
+                (*it)->eid = -1;
+                srt_epoll_release(eid);
+            }
         }
-        for (std::vector<SRTSOCKET>::const_iterator it = sfds_.begin(); it != sfds_.end(); ++it) {
-            if (*it != SRT_INVALID_SOCK) {
-                srt_close(*it);
+        for (std::vector<pshard_t>::const_iterator it = shards_.begin(); it != shards_.end(); ++it) {
+            if ((*it)->thread.joinable()) {
+                (*it)->thread.join();
+                //TRACE(_T("MESRT::Listener::Impl::Destroy (%s)\n"), A4T(option_.Get<std::string>("host", "")).c_str());
+            }
+            for (std::vector<SRTSOCKET>::const_iterator sfd = (*it)->sfds.begin(); sfd != (*it)->sfds.end(); ++sfd) {
+                if (*sfd != SRT_INVALID_SOCK) {
+                    srt_close(*sfd);
+                }
             }
+            (*it)->reader.Reset();
         }
-        sfds_.clear();
-        own_events_.clear();
+        shards_.clear();
+        events_.Clear();
     }
     virtual void AddEvent(Event::wptr_t ev, int priority, bool own) {
-        Event::AddEvent(mutex_, events_, ev, priority);
-        if (!own) return;
-        Event::ptr_t p = ev.lock();
-        if (!p) return;
-        boost::mutex::scoped_lock lk(mutex_);
-        own_events_.push_back(p);
-    }
-    virtual Event::vector_t GetEvents() {
-        return Event::GetEvents(mutex_, events_);
+        events_.Add(ev, priority, own);
     }
     virtual const ListenOption& GetOption() const {
         return option_;
     }
+    virtual std::string GetStatistics(const std::string& sep) {
+        return admission_.GetStatistics(sep);
+    }
     virtual std::string GetErrMsg(const std::string& sep) const {
         return errmsgs_(sep);
     }
 protected:
+    virtual bool Bind(SRTSOCKET sfd, const addrinfo* res, bool reuseport, int32_t ipv6Only) {
+        if (!reuseport) {
+            if (srt_bind(sfd, res->ai_addr, static_cast<int>(res->ai_addrlen)) == SRT_ERROR) {
+                errmsgs_ << boost::format("failed srt_bind() [ %s ]; %s") % SockAddr(res->ai_addr, res->ai_addrlen).ToString() % srt_getlasterror_str();
+                return false;
+            }
+            return true;
+        }
+#if defined(SO_REUSEPORT)
+        // every shard owns a udp socket on the same port so that the kernel spreads the peers over them
+        int udp = socket(res->ai_family, SOCK_DGRAM, IPPROTO_UDP);
+        if (udp < 0) {
+            errmsgs_ << boost::format("failed socket(): %s") % strerror(errno);
+            return false;
+        }
+        int on = 1;
+        if (setsockopt(udp, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+            errmsgs_ << boost::format("failed setsockopt(SO_REUSEPORT): %s") % strerror(errno);
+            close(udp);
+            return false;
+        }
+        if (res->ai_family == AF_INET6 && setsockopt(udp, IPPROTO_IPV6, IPV6_V6ONLY, &ipv6Only, sizeof(ipv6Only)) < 0) {
+            errmsgs_ << boost::format("failed setsockopt(IPV6_V6ONLY) [ %d ]: %s") % ipv6Only % strerror(errno);
+            close(udp);
+            return false;
+        }
+        if (bind(udp, res->ai_addr, static_cast<socklen_t>(res->ai_addrlen)) < 0) {
+            errmsgs_ << boost::format("failed bind() [ %s ]: %s") % SockAddr(res->ai_addr, res->ai_addrlen).ToString() % strerror(errno);
+            close(udp);
+            return false;
+        }
+        if (srt_bind_acquire(sfd, udp) == SRT_ERROR) {
+            errmsgs_ << boost::format("failed srt_bind_acquire() [ %s ]; %s") % SockAddr(res->ai_addr, res->ai_addrlen).ToString() % srt_getlasterror_str();
+            close(udp);
+            return false;
+        }
+        return true; // the udp socket is closed by srt along with the listener
+#else
+        return false;
+#endif
+    }
     static bool SetSockFlags(SRTSOCKET sfd, const ListenOption& option, SafeMessages& errmsgs) {
         if (option.Has("udpsndbuf")) {
             int udpsndbuf = option.Get<int>("udpsndbuf", 65536);
@@ -376,50 +615,57 @@ protected:
 #endif
         return true;
     }
-    virtual void Thread() {
+    virtual void Thread(size_t index) {
+        Affinity::Apply(Affinity::LISTENER);
+        Shard& shard = *shards_[index];
         try {
-            Poll();
+            Poll(shard, index == primary_);
         } catch (boost::thread_interrupted&) {
             errmsgs_ << "the thread has been interrupted.";
         } catch (std::exception& ev) {
             errmsgs_ << boost::format("an unexpected exception occurred: %s") % ev.what();
         }
-        ThreadExit();
+        if (index == primary_) ThreadExit(shard);
     }
-    virtual void Poll() {
-        int msTimeout = option_.Get<int>("epolltimeo", 100);
-        std::vector<SRTSOCKET> srtrfds(sfds_.size(), SRT_INVALID_SOCK);
-        for (; eid_ >= 0; CheckFlag(), boost::this_thread::interruption_point()) {
+    virtual void Poll(Shard& shard, bool primary) {
+        // no periodic wakeup; Destroy() releases the eid to end the wait
+        std::vector<SRTSOCKET> srtrfds(shard.sfds.size(), SRT_INVALID_SOCK);
+        for (; shard.eid >= 0; boost::this_thread::interruption_point()) {
             int srtrfdslen = static_cast<int>(srtrfds.size());
-            int n = srt_epoll_wait(eid_, &srtrfds.at(0), &srtrfdslen, 0, 0, msTimeout, 0, 0, 0, 0);
+            int n = srt_epoll_wait(shard.eid, &srtrfds.at(0), &srtrfdslen, 0, 0, -1, 0, 0, 0, 0);
             for (int i = 0; i < n; ++i) {
                 SRTSOCKET sfd = srtrfds[i];
                 SRT_SOCKSTATUS status = srt_getsockstate(sfd);
                 if (status == SRTS_LISTENING) {
-                    Accept(sfd);
+                    Accept(shard, sfd);
                 }
             }
+            if (primary) {
+                CheckFlag(shard); // listener flags are handled once per listener, when the thread wakes up
+            }
         }
     }
-    virtual void CheckFlag() {
-        Event::vector_t events = Event::GetEvents(mutex_, events_);
-        for (Event::vector_t::iterator it = events.begin(); it != events.end(); ++it) {
-            Event::ptr_t ev = *it;
-            if (ev->GetListenerFlag()) {
+    virtual void CheckFlag(Shard& shard) {
+        const Event::Set::entries_t& events = shard.reader();
+        for (Event::Set::entries_t::const_iterator it = events.begin(); it != events.end(); ++it) {
+            Event::ptr_t locked;
+            Event* ev = it->get(locked);
+            if (ev && ev->GetListenerFlag()) {
                 if (!ev->OnListenerFlag(option_)) {
                     ev->SetListenerFlag(false);
                 }
             }
         }
     }
-    virtual void ThreadExit() {
-        Event::vector_t events = Event::GetEvents(mutex_, events_);
-        for (Event::vector_t::iterator it = events.begin(); it != events.end(); ++it) {
-            Event::ptr_t ev = *it;
-            ev->OnThreadExit(option_);
+    virtual void ThreadExit(Shard& shard) {
+        const Event::Set::entries_t& events = shard.reader();
+        for (Event::Set::entries_t::const_iterator it = events.begin(); it != events.end(); ++it) {
+            Event::ptr_t locked;
+            Event* ev = it->get(locked);
+            if (ev) ev->OnThreadExit(option_);
         }
     }
-    virtual void Accept(SRTSOCKET listen) {
+    virtual void Accept(Shard& shard, SRTSOCKET listen) {
         int len = sizeof(sockaddr_storage);
         SockAddr peer;
         SRTSOCKET sfd = srt_accept(listen, reinterpret_cast<sockaddr*>(&peer), &len);
@@ -432,18 +678,21 @@ protected:
         int optlen = 512;
         srt_getsockflag(sfd, SRTO_STREAMID, optbuf, &optlen);
         StreamOption streamOption(optbuf);
-        Event::vector_t events = GetEvents();
-        for (Event::vector_t::const_iterator it = events.begin(); it != events.end(); ++it) {
-            Event::ptr_t ev = *it;
+        const Event::Set::entries_t& events = shard.reader();
+        for (Event::Set::entries_t::const_iterator it = events.begin(); it != events.end(); ++it) {
+            Event::ptr_t locked;
+            Event* ev = it->get(locked);
+            if (!ev) continue;
             if (ev->OnAccept(option_, static_cast<int>(sfd), peer, streamOption)) {
+                admission_.Accepted(sfd, true);
                 return;
-            } else {
+            } else if (it->own) {
                 // remove if owned event listener returns false
-                boost::mutex::scoped_lock lk(mutex_);
-                boost::range::remove_erase(own_events_, ev);
+                events_.Remove(it->hold);
             }
         }
         srt_close(sfd);
+        admission_.Accepted(sfd, false);
         errmsgs_ << boost::format("the connection from [ %s ] is not accepted(2); %s") % peer.ToString(), streamOption();
     }
     virtual int ListenCallback(SRTSOCKET ns, int hsversion, const struct sockaddr* peeraddr, const char* streamid) {
@@ -451,11 +700,24 @@ protected:
         // "Pre" options could be set in this context like SRTO_PASSPHRASE
         SockAddr peer(peeraddr);
         peer.ConvertV4MappedV6ToV4();
+        Admission::verdict_t verdict = admission_.Enter(ns, peer);
+        if (verdict != Admission::ADMIT) {
+#if SRT_VERSION_VALUE >= SRT_MAKE_VERSION_VALUE(1,4,2)
+            srt_setrejectreason(ns, SRT_REJX_OVERLOAD);
+#endif
+            return -1; // before any access check or webhook
+        }
+        int result = PreAccept(ns, peer, streamid);
+        admission_.Leave(ns, result == 0);
+        return result;
+    }
+    virtual int PreAccept(SRTSOCKET ns, const SockAddr& peer, const char* streamid) {
         StreamOption streamOption(streamid);
         ListenOption option; // "pre-bind" options could not be set in this context
-        Event::vector_t events = GetEvents();
-        for (Event::vector_t::const_iterator it = events.begin(); it != events.end(); ++it) {
-            Event::ptr_t ev = *it;
+        Event::Set::snapshot_t events = events_.Get(); // srt core thread; the reader belongs to the listening thread
+        for (Event::Set::entries_t::const_iterator it = events->begin(); it != events->end(); ++it) {
+            Event::ptr_t locked;
+            Event* ev = it->get(locked);
             if (ev && ev->OnPreAccept(option, ns, peer, streamOption)) {
                 if (!SetSockFlags(ns, option, errmsgs_)) {
                     return -1;
@@ -493,6 +755,9 @@ void Listener::AddEvent(Event::wptr_t ev, int priority, bool own) {
 const ListenOption& Listener::GetOption() const {
     return pimpl_->GetOption();
 }
+std::string Listener::GetStatistics(const std::string& sep) const {
+    return pimpl_->GetStatistics(sep);
+}
 std::string Listener::GetErrMsg(const std::string& sep) const {
     return pimpl_->GetErrMsg(sep);
 }
@@ -19,5 +19,6 @@ public:
     virtual void Destroy();
     virtual void AddEvent(Event::wptr_t ev, int priority, bool own = false);
     virtual const ListenOption& GetOption() const;
+    virtual std::string GetStatistics(const std::string& sep = ", ") const;
     virtual std::string GetErrMsg(const std::string& sep = "\n") const;
 };
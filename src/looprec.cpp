@@ -3,6 +3,20 @@
 #include "logger.h"
 #include "sender.h"
 #include "aws.h"
+#include "affinity.h"
+#include "timer.h"
+#include "janitor.h"
+#include "mpegts.h"
+
+#if !defined(WIN32) && !defined(WIN64)
+#include <fcntl.h>  // open, O_DIRECT
+#include <unistd.h> // write, fdatasync, ftruncate, close
+#endif
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>      // FS_IOC_FIEMAP
+#include <linux/fiemap.h>
+#endif
 
 //----------------------------------------------------------------------------
 ///
@@ -35,11 +49,14 @@ class Segment : public boost::enable_shared_from_this<Segment>, private boost::n
 {
 protected:
     const std::string log_prefix_;
-    boost::filesystem::path dat_path_;
+    boost::filesystem::path dat_path_;  // set before the segment is shared and kept after the files are removed
     boost::filesystem::path idx_path_;
     bool continuous_;
     bool expired_;
-    bool s3pushed_;
+    boost::atomic<bool> s3pushed_;
+    boost::atomic<bool> deleted_;       // the local files are removed
+    boost::atomic<bool> delete_posted_; // DeleteLocalIfS3Pushed() is queued to the janitor
+    uint64_t valid_;                    // index entries which may be played (set while the segments are loaded)
     std::string s3bucket_;
     boost::filesystem::path s3key_dat_;
     boost::filesystem::path s3key_idx_;
@@ -48,7 +65,7 @@ public:
     typedef std::map<boost::posix_time::ptime, ptr_t> map_t;
     Segment(const std::string& log_prefix, const boost::filesystem::path& path, const std::string& idx_ext, const std::string& s3bucket, const boost::filesystem::path& s3key = "")
         : log_prefix_(log_prefix), dat_path_(path), idx_path_(), continuous_(false), expired_(false)
-        , s3pushed_(false), s3bucket_(s3bucket), s3key_dat_(s3key), s3key_idx_() {
+        , s3pushed_(false), deleted_(false), delete_posted_(false), valid_(std::numeric_limits<uint64_t>::max()), s3bucket_(s3bucket), s3key_dat_(s3key), s3key_idx_() {
         if (!path.empty()) {
             (idx_path_ = path).replace_extension(idx_ext);
             continuous_ = boost::algorithm::ends_with(path.stem().string(), CONTINUOUS);
@@ -73,34 +90,48 @@ public:
         S3Delete(true);
     }
     virtual void SetLocalPath(const boost::filesystem::path& path, const std::string& idx_ext) {
+        // only while the segments are loaded, before any other thread sees this segment
         if (path.empty()) return;
         if (dat_path_.empty()) dat_path_ = path;
         if (idx_path_.empty()) (idx_path_ = path).replace_extension(idx_ext);
     }
+    virtual void SetValid(uint64_t valid) {
+        // only while the segments are loaded, before any other thread sees this segment
+        valid_ = valid;
+    }
+    virtual uint64_t Valid() const {
+        return valid_;
+    }
+    virtual bool PostDelete() {
+        // true only for the first caller until the posted deletion has run
+        return !delete_posted_.exchange(true);
+    }
     virtual void DeleteLocalIfS3Pushed() {
         if (s3pushed_) DeleteLocal(false);
+        delete_posted_ = false; // retried by the next scan if a file is left
     }
     virtual void DeleteLocal(bool log) {
-        boost::filesystem::path dat_path(dat_path_);
-        if (!dat_path.empty()) {
+        if (deleted_) return;
+        bool deleted = true;
+        if (!dat_path_.empty()) {
             boost::system::error_code ec;
-            if (boost::filesystem::remove(dat_path, ec)) {
-                if (log) Logger::Info(boost::format("%s : remove segment [%s]") % log_prefix_ % dat_path.filename().string());
-                dat_path_.clear();
-            } else {
-                Logger::Warning(boost::format("%s : failed to remove segment [%s] : %s") % log_prefix_ % dat_path.filename().string() % ec.to_string());
+            if (boost::filesystem::remove(dat_path_, ec)) {
+                if (log) Logger::Info(boost::format("%s : remove segment [%s]") % log_prefix_ % dat_path_.filename().string());
+            } else if (ec) {
+                Logger::Warning(boost::format("%s : failed to remove segment [%s] : %s") % log_prefix_ % dat_path_.filename().string() % ec.to_string());
+                deleted = false;
             }
         }
-        boost::filesystem::path idx_path(idx_path_);
-        if (!idx_path.empty()) {
+        if (!idx_path_.empty()) {
             boost::system::error_code ec;
-            if (boost::filesystem::remove(idx_path, ec)) {
-                if (log) Logger::Debug(boost::format("%s : remove segment index [%s]") % log_prefix_ % idx_path.filename().string());
-                idx_path_.clear();
-            } else {
-                Logger::Warning(boost::format("%s : failed to remove segment index [%s] : %s") % log_prefix_ % idx_path.filename().string() % ec.to_string());
+            if (boost::filesystem::remove(idx_path_, ec)) {
+                if (log) Logger::Debug(boost::format("%s : remove segment index [%s]") % log_prefix_ % idx_path_.filename().string());
+            } else if (ec) {
+                Logger::Warning(boost::format("%s : failed to remove segment index [%s] : %s") % log_prefix_ % idx_path_.filename().string() % ec.to_string());
+                deleted = false;
             }
         }
+        if (deleted) deleted_ = true;
     }
     virtual void S3Delete(bool log) {
         AWS::S3Client s3client;
@@ -129,6 +160,9 @@ public:
     virtual const boost::filesystem::path& S3KeyIdx() const {
         return s3key_idx_;
     }
+    virtual bool Deleted() const {
+        return deleted_;
+    }
     virtual bool Continuous() const {
         return continuous_;
     }
@@ -145,6 +179,7 @@ public:
         if (s3key_idx_.empty()) s3key_idx_ = s3folder + "/" + idx_path_.filename().string();
         ptr_t thiz(shared_from_this()); // keep shared_from_this until PutAsync done to guard from deletion
         boost::thread([this, thiz]() {
+            Affinity::Apply(Affinity::UPLOADER);
             {
                 boost::shared_ptr<AWS::S3Client> s3client(new AWS::S3Client);
                 AWS::S3Put put_idx = s3client->PutAsync(s3bucket_, s3key_idx_.string(), idx_path_.string());
@@ -152,78 +187,501 @@ public:
                 if (!put_idx.Wait() || !put_dat.Wait()) return;
             }
             s3pushed_ = true;
-            DeleteLocalIfS3Pushed();
+            DeleteLocal(false);
         });
     }
 };
 
+//----------------------------------------------------------------------------
+/// @class SegmentFile
+/// write-only file of a segment; with O_DIRECT the buffer, the size and the offset have to be aligned
+//----------------------------------------------------------------------------
+class SegmentFile : private boost::noncopyable
+{
+#if defined(WIN32) || defined(WIN64)
+    std::ofstream file_;
+#else
+    int fd_;
+#endif
+    bool direct_;
+public:
+    static const size_t ALIGN = 4096;
+#if defined(WIN32) || defined(WIN64)
+    SegmentFile() : file_(), direct_(false) {
+    }
+#else
+    SegmentFile() : fd_(-1), direct_(false) {
+    }
+#endif
+    virtual ~SegmentFile() {
+        Close();
+    }
+    virtual bool Open(const boost::filesystem::path& path, bool direct) {
+#if defined(WIN32) || defined(WIN64)
+        file_.rdbuf()->pubsetbuf(nullptr, 0); // the writer has its own buffer
+        file_.open(path.string(), std::ios::out | std::ios::trunc | std::ios::binary);
+        return file_.is_open();
+#else
+        int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#if defined(O_DIRECT)
+        if (direct) {
+            fd_ = ::open(path.c_str(), flags | O_DIRECT, 0644);
+            if (fd_ >= 0) {
+                direct_ = true;
+                return true;
+            }
+            // not supported by the file system (e.g. tmpfs)
+        }
+#endif
+        fd_ = ::open(path.c_str(), flags, 0644);
+        return fd_ >= 0;
+#endif
+    }
+    virtual bool IsOpen() const {
+#if defined(WIN32) || defined(WIN64)
+        return file_.is_open();
+#else
+        return fd_ >= 0;
+#endif
+    }
+    virtual bool Direct() const {
+        return direct_;
+    }
+    virtual void SetDirect(bool direct) {
+        // for the unaligned tail at the end of the segment
+#if !defined(WIN32) && !defined(WIN64) && defined(O_DIRECT)
+        if (fd_ < 0 || direct == direct_) return;
+        int flags = fcntl(fd_, F_GETFL);
+        if (flags < 0 || fcntl(fd_, F_SETFL, direct ? (flags | O_DIRECT) : (flags & ~O_DIRECT)) < 0) return;
+        direct_ = direct;
+#endif
+    }
+    virtual bool Write(const char* data, size_t size) {
+#if defined(WIN32) || defined(WIN64)
+        file_.write(data, size);
+        return file_.good();
+#else
+        while (size > 0) {
+            ssize_t n = ::write(fd_, data, size);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data += n;
+            size -= static_cast<size_t>(n);
+        }
+        return true;
+#endif
+    }
+    virtual bool Allocate(int64_t size) {
+        // reserves blocks without changing the file size, so that readers never see the reserved part
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+        return fd_ >= 0 && fallocate(fd_, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(size)) == 0;
+#else
+        return false;
+#endif
+    }
+    virtual bool Truncate(int64_t size) {
+        // also releases the blocks reserved beyond the size
+#if defined(WIN32) || defined(WIN64)
+        return false;
+#else
+        return fd_ >= 0 && ftruncate(fd_, static_cast<off_t>(size)) == 0;
+#endif
+    }
+    virtual int32_t Extents() const {
+        // number of extents of the file (-1:unknown)
+#if defined(__linux__) && defined(FS_IOC_FIEMAP)
+        struct fiemap fm;
+        memset(&fm, 0, sizeof(fm));
+        fm.fm_length = FIEMAP_MAX_OFFSET;
+        fm.fm_extent_count = 0; // count only
+        if (fd_ < 0 || ioctl(fd_, FS_IOC_FIEMAP, &fm) < 0) return -1;
+        return static_cast<int32_t>(fm.fm_mapped_extents);
+#else
+        return -1;
+#endif
+    }
+    virtual bool Sync() {
+#if defined(WIN32) || defined(WIN64)
+        file_.flush();
+        return file_.good();
+#elif defined(__APPLE__)
+        return fsync(fd_) == 0;
+#else
+        return fdatasync(fd_) == 0;
+#endif
+    }
+    virtual void Close() {
+#if defined(WIN32) || defined(WIN64)
+        if (file_.is_open()) file_.close();
+#else
+        if (fd_ >= 0) ::close(fd_);
+        fd_ = -1;
+#endif
+        direct_ = false;
+    }
+};
+
+//----------------------------------------------------------------------------
+/// @class SegmentIndex
+/// layout of the index files
+/// v1: a raw std::streamoff per index interval (byte order by "index_endian")
+/// v2: a self-describing header followed by blocks of fixed-width entries, each block closed by its CRC-32;
+///     every field is little-endian, and the last block is closed when the segment is closed
+//----------------------------------------------------------------------------
+class SegmentIndex
+{
+public:
+    static const size_t MAGIC_SIZE = 8;
+    static const uint16_t VERSION = 2;
+    static const size_t HEADER = 64;
+    static const size_t ENTRY = 40;
+    static const size_t BLOCK = 64;   // entries per CRC
+    static const size_t CRC = 4;
+    enum {
+        FLAG_RAP = 0x01,              // a random access point is in the interval (Entry::rap is valid)
+        FLAG_PCR = 0x02,              // a PCR is in the interval (Entry::pcr is valid)
+    };
+    struct Header {
+        uint16_t version;
+        uint16_t header;              // bytes of the header
+        uint16_t entry;               // bytes of an entry
+        uint16_t block;               // entries per CRC
+        uint32_t interval;            // index interval (msec)
+        int64_t created;              // wallclock of the first entry (usec since the epoch, UTC)
+        std::streamoff Position(uint64_t n) const {
+            // of the n-th entry
+            return header + static_cast<std::streamoff>(n / block * (block * entry + CRC) + n % block * entry);
+        }
+    };
+    struct Entry {
+        uint64_t offset;              // data offset at the start of the interval
+        uint64_t rap;                 // data offset to start decoding from (PAT/PMT before the keyframe when present)
+        int64_t wallclock;            // usec since the epoch (UTC) when the entry was made
+        uint64_t pcr;                 // first PCR in the interval (27MHz)
+        uint32_t flags;
+    };
+    static const char* Magic() {
+        return "SRTLRIDX";
+    }
+    static uint32_t Crc(const char* data, size_t size) {
+        boost::crc_32_type crc;
+        crc.process_bytes(data, size);
+        return crc.checksum();
+    }
+    template <typename Type> static void Put(std::string& out, Type val) {
+        boost::endian::native_to_little_inplace(val);
+        out.append(reinterpret_cast<const char*>(&val), sizeof(Type));
+    }
+    template <typename Type> static Type Get(const char* in) {
+        Type val;
+        memcpy(&val, in, sizeof(Type));
+        return boost::endian::little_to_native(val);
+    }
+    static std::string Encode(const Header& header) {
+        std::string out(Magic(), MAGIC_SIZE);
+        Put(out, header.version);
+        Put(out, header.header);
+        Put(out, header.entry);
+        Put(out, header.block);
+        Put(out, header.interval);
+        Put<uint32_t>(out, 0);
+        Put(out, header.created);
+        out.resize(HEADER - CRC, '\0');
+        Put(out, Crc(out.data(), out.size()));
+        return out;
+    }
+    static bool Decode(const char* in, size_t size, Header& header) {
+        // false unless a v2 (or later) header is valid
+        if (size < HEADER || memcmp(in, Magic(), MAGIC_SIZE) != 0) return false;
+        if (Get<uint32_t>(in + HEADER - CRC) != Crc(in, HEADER - CRC)) return false;
+        header.version = Get<uint16_t>(in + 8);
+        header.header = Get<uint16_t>(in + 10);
+        header.entry = Get<uint16_t>(in + 12);
+        header.block = Get<uint16_t>(in + 14);
+        header.interval = Get<uint32_t>(in + 16);
+        header.created = Get<int64_t>(in + 24);
+        return header.version >= VERSION && header.header >= HEADER && header.entry >= ENTRY && header.block > 0 && header.interval > 0;
+    }
+    static void Encode(const Entry& entry, std::string& out) {
+        Put(out, entry.offset);
+        Put(out, entry.rap);
+        Put(out, entry.wallclock);
+        Put(out, entry.pcr);
+        Put(out, entry.flags);
+        Put<uint32_t>(out, 0);
+    }
+    static Entry Decode(const char* in) {
+        Entry entry = { Get<uint64_t>(in), Get<uint64_t>(in + 8), Get<int64_t>(in + 16), Get<uint64_t>(in + 24), Get<uint32_t>(in + 32) };
+        return entry;
+    }
+    static bool Validate(const boost::filesystem::path& idx_path, const boost::filesystem::path& dat_path, std::string& error, uint64_t& valid) {
+        // checks the header, the CRC of every block and the entries against the data size without reading the data;
+        // valid is the number of entries from the start which may be used (max:all)
+        valid = 0;
+        std::ifstream file(idx_path.string(), std::ios::in | std::ios::binary);
+        if (!file.is_open()) {
+            error = "not found";
+            return false;
+        }
+        boost::system::error_code ec;
+        uint64_t dat_size = boost::filesystem::file_size(dat_path, ec);
+        if (ec) dat_size = 0;
+        std::string buf(HEADER, '\0');
+        size_t size = static_cast<size_t>(file.read(&buf.at(0), HEADER).gcount());
+        Header header;
+        if (size < MAGIC_SIZE || memcmp(buf.data(), Magic(), MAGIC_SIZE) != 0) {
+            // v1 has no header; the first entry is always 0
+            uint64_t length = boost::filesystem::file_size(idx_path, ec);
+            if (ec) {
+                error = "not found";
+                return false;
+            }
+            valid = length / sizeof(std::streamoff);
+            if (length % sizeof(std::streamoff) != 0) {
+                error = "truncated entry";
+                return false;
+            }
+            valid = std::numeric_limits<uint64_t>::max();
+            return true;
+        }
+        if (!Decode(buf.data(), size, header)) {
+            error = "invalid header";
+            return false;
+        }
+        file.seekg(header.header);
+        const size_t entries = header.block * header.entry;
+        for (uint64_t block = 0;; ++block) {
+            buf.resize(entries + CRC);
+            size = static_cast<size_t>(file.read(&buf.at(0), buf.size()).gcount());
+            if (size == 0) break;
+            size_t count = std::min(size, entries) / header.entry;
+            size_t rest = size - count * header.entry;
+            if (rest != 0 && rest != CRC) {
+                error = (boost::format("truncated entry in block %llu") % block).str();
+                return false;
+            }
+            if (rest == CRC && Get<uint32_t>(buf.data() + count * header.entry) != Crc(buf.data(), count * header.entry)) {
+                error = (boost::format("CRC mismatch in block %llu") % block).str();
+                return false;
+            }
+            for (size_t i = 0; i < count; ++i, ++valid) {
+                uint64_t offset = Decode(buf.data() + i * header.entry).offset;
+                if (offset > dat_size) {
+                    error = (boost::format("entry beyond the data (%llu > %llu)") % offset % dat_size).str();
+                    return false;
+                }
+            }
+            if (size < buf.size()) break; // the last block (unclosed if the recording was interrupted)
+        }
+        valid = std::numeric_limits<uint64_t>::max();
+        return true;
+    }
+};
+
 //----------------------------------------------------------------------------
 /// @class SegmentWriter
+/// packets are gathered in an aligned buffer and committed together with their index entries
+/// when the buffer is full or the commit interval has passed
 //----------------------------------------------------------------------------
 class SegmentWriter
 {
+public:
+    struct Commit {
+        size_t buffer;                        // bytes gathered before writing
+        boost::chrono::milliseconds interval; // maximum age of data not yet written (durability window)
+        bool direct;                          // O_DIRECT (Linux only)
+        bool sync;                            // fdatasync on every commit
+        int64_t preallocate;                  // bytes reserved when the segment is created (0:none, Linux only)
+    };
+    struct Report {
+        int64_t written;                      // bytes of the data file
+        int64_t allocated;                    // bytes reserved in advance (0:not reserved)
+        int64_t allocUs;                      // time taken to reserve (usec)
+        int32_t extents;                      // extents of the data file when closed (-1:unknown)
+        boost::chrono::steady_clock::duration elapsed; // from the creation to the close
+    };
+private:
     const std::string log_prefix_;
     const Segment::ptr_t segment_;
-    std::ofstream dat_file_;
-    std::ofstream idx_file_;
+    SegmentFile dat_file_;
+    SegmentFile idx_file_;
     const boost::chrono::milliseconds idx_interval_;
     const std::function<std::streampos(std::streampos)> idx_endian_;
+    const int idx_version_;
+    const int64_t idx_created_;         // wallclock of the first entry (usec)
     boost::chrono::steady_clock::time_point idx_time_;
+    const Commit commit_;
+    boost::chrono::steady_clock::time_point commit_time_;
+    char* buf_;                         // aligned for O_DIRECT
+    size_t buf_capacity_;
+    size_t buf_size_;
+    std::streamoff written_;            // bytes written to the data file
+    std::deque<SegmentIndex::Entry> idx_; // index entries not yet written; the last one is open until the next is made (v2)
+    uint64_t idx_entries_;              // index entries made
+    uint64_t idx_written_;              // index entries written
+    boost::crc_32_type idx_crc_;        // of the current block
+    std::streamoff pat_;                // data offset of the last PAT since the last random access point (-1:none)
+    const boost::chrono::steady_clock::time_point created_;
+    Report report_;
 public:
     typedef boost::shared_ptr<SegmentWriter> ptr_t;
     SegmentWriter(const std::string& log_prefix, Segment::ptr_t segment, const boost::chrono::milliseconds& idx_interval
-        , std::function<std::streampos(std::streampos)> idx_endian, const boost::chrono::steady_clock::time_point& idx_time)
-        : log_prefix_(log_prefix), segment_(segment), dat_file_(), idx_file_(), idx_interval_(idx_interval), idx_endian_(idx_endian), idx_time_(idx_time) {
+        , std::function<std::streampos(std::streampos)> idx_endian, int idx_version, const boost::posix_time::ptime& utc
+        , const boost::chrono::steady_clock::time_point& idx_time, const Commit& commit)
+        : log_prefix_(log_prefix), segment_(segment), dat_file_(), idx_file_(), idx_interval_(idx_interval), idx_endian_(idx_endian), idx_version_(idx_version)
+        , idx_created_((utc - boost::posix_time::ptime(boost::gregorian::date(1970, 1, 1))).total_microseconds()), idx_time_(idx_time)
+        , commit_(commit), commit_time_(idx_time + commit.interval), buf_(nullptr), buf_capacity_(0), buf_size_(0), written_(0)
+        , idx_(), idx_entries_(0), idx_written_(0), idx_crc_(), pat_(-1), created_(idx_time), report_() {
+        report_.extents = -1;
     }
     virtual ~SegmentWriter() {
         Destroy();
+        boost::alignment::aligned_free(buf_);
     }
     virtual bool Initialize() {
         if (!segment_) {
             return false;
         }
-        dat_file_.open(segment_->DatPath().string(), std::ios::out | std::ios::trunc | std::ios::binary);
-        if (dat_file_.is_open()) {
-            Logger::Info(boost::format("%s : create segment [%s]") % log_prefix_ % segment_->DatPath().filename().string());
+        buf_capacity_ = (std::max<size_t>(commit_.buffer, 1) + SegmentFile::ALIGN - 1) / SegmentFile::ALIGN * SegmentFile::ALIGN;
+        buf_ = static_cast<char*>(boost::alignment::aligned_alloc(SegmentFile::ALIGN, buf_capacity_));
+        if (!buf_) {
+            return false;
+        }
+        if (dat_file_.Open(segment_->DatPath(), commit_.direct)) {
+            Logger::Info(boost::format("%s : create segment [%s]%s") % log_prefix_ % segment_->DatPath().filename().string() % (dat_file_.Direct() ? " (direct)" : ""));
+            if (commit_.preallocate > 0) {
+                boost::chrono::steady_clock::time_point start = boost::chrono::steady_clock::now();
+                if (dat_file_.Allocate(commit_.preallocate)) report_.allocated = commit_.preallocate;
+                report_.allocUs = boost::chrono::duration_cast<boost::chrono::microseconds>(boost::chrono::steady_clock::now() - start).count();
+            }
         }
-        idx_file_.open(segment_->IdxPath().string(), std::ios::out | std::ios::trunc | std::ios::binary);
-        if (idx_file_.is_open()) {
-            Logger::Debug(boost::format("%s : create segment index [%s]") % log_prefix_ % segment_->IdxPath().filename().string());
+        if (idx_file_.Open(segment_->IdxPath(), false)) {
+            Logger::Debug(boost::format("%s : create segment index [%s] (v%d)") % log_prefix_ % segment_->IdxPath().filename().string() % idx_version_);
+            if (idx_version_ >= SegmentIndex::VERSION) {
+                SegmentIndex::Header header = {
+                    SegmentIndex::VERSION, SegmentIndex::HEADER, SegmentIndex::ENTRY, SegmentIndex::BLOCK, static_cast<uint32_t>(idx_interval_.count()), idx_created_
+                };
+                std::string bytes = SegmentIndex::Encode(header);
+                if (!idx_file_.Write(bytes.data(), bytes.size())) return Failed(segment_->IdxPath());
+            }
         }
         return WriteIndex();
     }
     virtual void Destroy() {
         Close("");
     }
-    virtual bool Write(const boost::chrono::steady_clock::time_point& tick, const Event::buf_t& buf) {
-        if (!dat_file_.is_open()) return false;
-        dat_file_.write(&buf.at(0), buf.size());
-        bool flush = false;
+    virtual bool Write(const boost::chrono::steady_clock::time_point& tick, const Packet& pkt) {
+        if (!dat_file_.IsOpen()) return false;
+        if (idx_version_ >= SegmentIndex::VERSION && !idx_.empty()) Mark(idx_.back(), pkt);
+        for (const char* data = pkt.Data(), *end = data + pkt.Size(); data < end;) {
+            size_t n = std::min<size_t>(end - data, buf_capacity_ - buf_size_);
+            memcpy(buf_ + buf_size_, data, n);
+            buf_size_ += n;
+            data += n;
+            if (buf_size_ == buf_capacity_ && !Flush(false)) return false;
+        }
+        return Tick(tick);
+    }
+    virtual bool Tick(const boost::chrono::steady_clock::time_point& tick) {
+        // also called while no packet arrives so that the commit interval stays an upper bound
+        if (!dat_file_.IsOpen()) return false;
         while (tick >= idx_time_) {
             if (!WriteIndex()) return false;
-            flush = true;
         }
-        if (flush) Flush();
-        return true;
+        if (tick < commit_time_) return true;
+        commit_time_ = tick + commit_.interval;
+        return Flush(false);
     }
     virtual void Close(const std::string& s3folder) {
-        if (dat_file_.is_open()) dat_file_.close();
-        if (idx_file_.is_open()) idx_file_.close();
+        if (dat_file_.IsOpen() && Flush(true)) {
+            if (report_.allocated > 0) dat_file_.Truncate(written_);
+            report_.written = written_;
+            report_.extents = dat_file_.Extents();
+            report_.elapsed = boost::chrono::steady_clock::now() - created_;
+        }
+        dat_file_.Close();
+        idx_file_.Close();
         if (!s3folder.empty() && segment_) segment_->S3Push(s3folder);
     }
-    virtual void Flush() {
-        if (dat_file_.is_open()) dat_file_.flush();
-        if (idx_file_.is_open()) idx_file_.flush();
+    virtual const Report& GetReport() const {
+        // valid after Close()
+        return report_;
+    }
+    virtual bool Flush(bool last) {
+        // data first so that the index never points beyond the data file
+        if (!dat_file_.IsOpen() || !idx_file_.IsOpen()) return false;
+        if (last) dat_file_.SetDirect(false);
+        size_t size = dat_file_.Direct() ? buf_size_ / SegmentFile::ALIGN * SegmentFile::ALIGN : buf_size_;
+        if (size > 0) {
+            if (!dat_file_.Write(buf_, size)) return Failed(segment_->DatPath());
+            memmove(buf_, buf_ + size, buf_size_ - size); // the unaligned tail
+            buf_size_ -= size;
+            written_ += size;
+        }
+        std::string entries;
+        if (idx_version_ >= SegmentIndex::VERSION) {
+            // an entry is complete when the next one is made, and everything it points to is written by then
+            while (!idx_.empty() && (last || (idx_.size() > 1 && static_cast<std::streamoff>(idx_[1].offset) <= written_))) {
+                size_t size = entries.size();
+                SegmentIndex::Encode(idx_.front(), entries);
+                idx_crc_.process_bytes(entries.data() + size, entries.size() - size);
+                idx_.pop_front();
+                if (++idx_written_ % SegmentIndex::BLOCK == 0) {
+                    SegmentIndex::Put(entries, idx_crc_.checksum());
+                    idx_crc_.reset();
+                }
+            }
+            if (last && idx_written_ % SegmentIndex::BLOCK != 0) {
+                SegmentIndex::Put(entries, idx_crc_.checksum()); // closes the last block
+                idx_crc_.reset();
+            }
+        } else {
+            for (; !idx_.empty() && static_cast<std::streamoff>(idx_.front().offset) <= written_; idx_.pop_front()) {
+                std::streamoff pos = idx_endian_(static_cast<std::streamoff>(idx_.front().offset));
+                entries.append(reinterpret_cast<const char*>(&pos), sizeof(std::streamoff));
+            }
+        }
+        if (!entries.empty() && !idx_file_.Write(entries.data(), entries.size())) return Failed(segment_->IdxPath());
+        if (commit_.sync && (!dat_file_.Sync() || !idx_file_.Sync())) return Failed(segment_->DatPath());
+        return true;
     }
 protected:
     virtual bool WriteIndex() {
-        if (!dat_file_.is_open() || !idx_file_.is_open()) return false;
-        std::streamoff pos = dat_file_.tellp();
-        pos = idx_endian_(pos);
-        idx_file_.write(reinterpret_cast<const char*>(&pos), sizeof(std::streamoff));
+        if (!dat_file_.IsOpen() || !idx_file_.IsOpen()) return false;
+        SegmentIndex::Entry entry = {
+            static_cast<uint64_t>(written_ + static_cast<std::streamoff>(buf_size_)), 0,
+            boost::chrono::duration_cast<boost::chrono::microseconds>(boost::chrono::system_clock::now().time_since_epoch()).count(), 0, 0
+        };
+        if (!idx_.empty() && pat_ < static_cast<std::streamoff>(idx_.back().offset)) pat_ = -1; // a PAT is carried over one interval at most
+        idx_.push_back(entry);
+        ++idx_entries_;
         idx_time_ += idx_interval_;
         return true;
     }
+    virtual void Mark(SegmentIndex::Entry& entry, const Packet& pkt) {
+        // pkt is about to be appended to the interval of entry;
+        // FLAG_RAP is set by MpegTs::Parser for the video PID of the PMT only, so an audio RAI never makes a random access point
+        std::streamoff offset = written_ + static_cast<std::streamoff>(buf_size_);
+        if (pkt.Flags() & Packet::FLAG_PAT) pat_ = offset;
+        if (pkt.IsRandomAccess()) {
+            if (!(entry.flags & SegmentIndex::FLAG_RAP)) {
+                entry.rap = static_cast<uint64_t>(pat_ >= 0 ? pat_ : offset);
+                entry.flags |= SegmentIndex::FLAG_RAP;
+            }
+            pat_ = -1;
+        }
+        if (!(entry.flags & SegmentIndex::FLAG_PCR) && MpegTs::Pcr(pkt.Data(), pkt.Size(), entry.pcr)) {
+            entry.flags |= SegmentIndex::FLAG_PCR;
+        }
+    }
+    virtual bool Failed(const boost::filesystem::path& path) {
+        Logger::Warning(boost::format("%s : failed to write segment [%s] : %s") % log_prefix_ % path.filename().string() % strerror(errno));
+        dat_file_.Close();
+        idx_file_.Close();
+        return false;
+    }
 };
 
 //----------------------------------------------------------------------------
@@ -236,8 +694,14 @@ class SegmentReader
     const Speed speed_;
     std::ifstream dat_file_;
     std::ifstream idx_file_;
-    const boost::chrono::milliseconds idx_interval_;
+    boost::chrono::milliseconds idx_interval_;  // by the header (v2) or by the configuration (v1)
     const std::function<std::streampos(std::streampos)> idx_endian_;
+    SegmentIndex::Header header_;                // version 1 without the header
+    std::string block_;                          // the current block of v2 read so far
+    size_t parsed_;                              // entries of block_ decoded
+    std::deque<SegmentIndex::Entry> entries_;    // entries decoded but not yet used
+    bool corrupted_;
+    uint64_t index_;                             // v1: of the next entry, v2: of the first entry of block_
     const boost::chrono::steady_clock::time_point base_time_;
     std::streamoff pos_;
     std::streamoff next_;
@@ -254,7 +718,7 @@ public:
     SegmentReader(const std::string& log_prefix, Segment::ptr_t segment, const Speed& speed, const boost::chrono::milliseconds& idx_interval
         , std::function<std::streampos(std::streampos)> idx_endian, const boost::chrono::steady_clock::time_point& base_time)
         : log_prefix_(log_prefix), segment_(segment), speed_(speed), dat_file_(), idx_file_()
-        , idx_interval_(idx_interval), idx_endian_(idx_endian), base_time_(base_time), pos_(0), next_(0), read_(0), pos_ns_(0), reached_idx_end_(false)
+        , idx_interval_(idx_interval), idx_endian_(idx_endian), header_(), block_(), parsed_(0), entries_(), corrupted_(false), index_(0), base_time_(base_time), pos_(0), next_(0), read_(0), pos_ns_(0), reached_idx_end_(false)
         , s3get_dat_(), s3get_idx_(), dat_stream_(nullptr), idx_stream_(nullptr), burst_(false) {
     }
     virtual ~SegmentReader() {
@@ -274,57 +738,55 @@ public:
                 Logger::Warning(boost::format("%s : failed to open segment [%s]") % log_prefix_ % segment_->S3KeyDat().filename().string());
                 return false;
             }
-            int64_t offset = offset_ms / idx_interval_.count();
-            s3get_idx_ = s3client.GetAsync(s3bucket, segment_->S3KeyIdx().string(), offset * sizeof(std::streamoff));
-            if (s3get_idx_.GetStream().read(reinterpret_cast<char*>(&pos_), sizeof(std::streamoff)).gcount() < static_cast<std::streamsize>(sizeof(std::streamoff))) {
-                Logger::Trace(boost::format("%s : failed to read segment index (%s[ms]) [%s]") % log_prefix_ % offset_ms % segment_->S3KeyIdx().filename().string());
-                reached_idx_end_ = true;
+            // the header and the entries are read from one GET
+            s3get_idx_ = s3client.GetAsync(s3bucket, segment_->S3KeyIdx().string(), 0);
+            std::streamoff read = 0;
+            if (!ReadHeader(s3get_idx_.GetStream(), segment_->S3KeyIdx(), read)) {
+                s3get_idx_.Abort();
                 return false;
             }
-            pos_ = idx_endian_(pos_);
-            if (s3get_idx_.GetStream().read(reinterpret_cast<char*>(&next_), sizeof(std::streamoff)).gcount() < static_cast<std::streamsize>(sizeof(std::streamoff))) {
-                Logger::Trace(boost::format("%s : failed to read segment index (%s[ms] next) [%s]") % log_prefix_ % offset_ms % segment_->S3KeyIdx().filename().string());
-                reached_idx_end_ = true;
+            int64_t offset = offset_ms / idx_interval_.count();
+            std::streamoff position = Start(offset);
+            if (position >= read) {
+                s3get_idx_.GetStream().ignore(position - read);
+            } else {
+                // the first entries of v1 were read as a header candidate
+                s3get_idx_.Abort();
+                s3get_idx_ = s3client.GetAsync(s3bucket, segment_->S3KeyIdx().string(), position);
+            }
+            idx_stream_ = &s3get_idx_.GetStream();
+            if (!Seek(offset, offset_ms, segment_->S3KeyIdx())) {
+                idx_stream_ = nullptr;
                 return false;
             }
-            next_ = idx_endian_(next_);
             s3get_dat_ = AWS::S3Client().GetAsync(s3bucket, segment_->S3KeyDat().string(), pos_, s3bufsiz); // another S3Client for segment data
             Logger::Debug(boost::format("%s : open segment [%s]") % log_prefix_ % segment_->S3KeyDat().filename().string());
-            read_ = 0;
-            pos_ns_ = offset * 1000ll * 1000 * idx_interval_.count(); // millisec to nanosec
             dat_stream_ = &s3get_dat_.GetStream();
-            idx_stream_ = &s3get_idx_.GetStream();
         } else {
             idx_file_.open(segment_->IdxPath().string(), std::ios::in | std::ios::binary);
             if (!idx_file_.is_open()) {
                 Logger::Warning(boost::format("%s : failed to open segment index [%s]") % log_prefix_ % segment_->IdxPath().filename().string());
                 return false;
             }
+            std::streamoff read = 0;
+            if (!ReadHeader(idx_file_, segment_->IdxPath(), read)) return false;
             int64_t offset = offset_ms / idx_interval_.count();
-            idx_file_.seekg(offset * sizeof(std::streamoff));
-            if (idx_file_.read(reinterpret_cast<char*>(&pos_), sizeof(std::streamoff)).gcount() < static_cast<std::streamsize>(sizeof(std::streamoff))) {
-                Logger::Trace(boost::format("%s : failed to read segment index (%s[ms]) [%s]") % log_prefix_ % offset_ms % segment_->IdxPath().filename().string());
-                reached_idx_end_ = true;
-                return false;
-            }
-            pos_ = idx_endian_(pos_);
-            if (idx_file_.read(reinterpret_cast<char*>(&next_), sizeof(std::streamoff)).gcount() < static_cast<std::streamsize>(sizeof(std::streamoff))) {
-                Logger::Trace(boost::format("%s : failed to read segment index (%s[ms] next) [%s]") % log_prefix_ % offset_ms % segment_->IdxPath().filename().string());
-                reached_idx_end_ = true;
+            idx_file_.clear();
+            idx_file_.seekg(Start(offset));
+            idx_stream_ = &idx_file_;
+            if (!Seek(offset, offset_ms, segment_->IdxPath())) {
+                idx_stream_ = nullptr;
                 return false;
             }
-            next_ = idx_endian_(next_);
             dat_file_.open(segment_->DatPath().string(), std::ios::in | std::ios::binary);
             if (!dat_file_.is_open()) {
                 Logger::Warning(boost::format("%s : failed to open segment [%s]") % log_prefix_ % segment_->DatPath().filename().string());
+                idx_stream_ = nullptr;
                 return false;
             }
             Logger::Debug(boost::format("%s : open segment [%s]") % log_prefix_ % segment_->DatPath().filename().string());
             dat_file_.seekg(pos_);
-            read_ = 0;
-            pos_ns_ = offset * 1000ll * 1000 * idx_interval_.count(); // millisec to nanosec
             dat_stream_ = &dat_file_;
-            idx_stream_ = &idx_file_;
         }
         return true;
     }
@@ -384,12 +846,12 @@ public:
         while (pos_ + read_ >= next_) {
             std::streamoff next = 0;
             boost::chrono::steady_clock::time_point s1 = boost::chrono::steady_clock::now();
-            size_t idx_read = idx_stream_->read(reinterpret_cast<char*>(&next), sizeof(std::streamoff)).gcount();
+            bool idx_read = NextOffset(next);
             int64_t e1 = (boost::chrono::steady_clock::now() - s1).count();
             if (e1 >= 1000ll * 1000 * 30) {
                 Logger::Debug(boost::format("%s : it took %lf[ms] to read the index") % log_prefix_ % (static_cast<double>(e1) / 1000.0 / 1000.0));
             }
-            if (idx_read < static_cast<std::streamsize>(sizeof(std::streamoff))) {
+            if (!idx_read) {
                 reached_idx_end_ = true;
                 break;
             }
@@ -399,7 +861,7 @@ public:
             }
             pos_ns_ += 1000ll * 1000 * idx_interval_.count();
             pos_ = next_;
-            next_ = idx_endian_(next);
+            next_ = next;
         }
         return true;
     }
@@ -418,6 +880,120 @@ public:
     bool IsBurst() const {
         return burst_;
     }
+protected:
+    virtual bool ReadHeader(std::istream& is, const boost::filesystem::path& path, std::streamoff& read) {
+        // v1 has no header; its first entry is always 0 and never matches the magic
+        char buf[SegmentIndex::HEADER];
+        size_t size = static_cast<size_t>(is.read(buf, sizeof(buf)).gcount());
+        read = static_cast<std::streamoff>(size);
+        if (size < SegmentIndex::MAGIC_SIZE || memcmp(buf, SegmentIndex::Magic(), SegmentIndex::MAGIC_SIZE) != 0) {
+            header_.version = 1;
+            return true;
+        }
+        if (!SegmentIndex::Decode(buf, size, header_)) {
+            Logger::Warning(boost::format("%s : invalid segment index header [%s]") % log_prefix_ % path.filename().string());
+            return false;
+        }
+        idx_interval_ = boost::chrono::milliseconds(header_.interval);
+        return true;
+    }
+    virtual std::streamoff Start(int64_t offset) {
+        // Position() of the offset-th entry, from which the entries are counted against Segment::Valid()
+        index_ = header_.version < SegmentIndex::VERSION ? static_cast<uint64_t>(offset) : static_cast<uint64_t>(offset) / header_.block * header_.block;
+        return Position(offset);
+    }
+    virtual std::streamoff Position(int64_t offset) const {
+        // where to start reading the index for the offset-th entry (the start of its block for v2)
+        if (header_.version < SegmentIndex::VERSION) return offset * sizeof(std::streamoff);
+        return header_.Position(static_cast<uint64_t>(offset) / header_.block * header_.block);
+    }
+    virtual bool Seek(int64_t offset, int64_t offset_ms, const boost::filesystem::path& path) {
+        // sets pos_ and next_ for the offset-th entry; v2 starts at the first random access point from there within the block
+        if (header_.version >= SegmentIndex::VERSION) {
+            SegmentIndex::Entry entry;
+            for (int64_t skip = offset % header_.block; skip >= 0; --skip) {
+                if (!NextEntry(entry)) {
+                    Logger::Trace(boost::format("%s : failed to read segment index (%s[ms]) [%s]") % log_prefix_ % offset_ms % path.filename().string());
+                    reached_idx_end_ = true;
+                    return false;
+                }
+            }
+            if (!(entry.flags & SegmentIndex::FLAG_RAP)) {
+                std::deque<SegmentIndex::Entry>::iterator it = std::find_if(entries_.begin(), entries_.end(), [](const SegmentIndex::Entry& e) {
+                    return (e.flags & SegmentIndex::FLAG_RAP) != 0;
+                });
+                if (it != entries_.end()) {
+                    offset += (it - entries_.begin()) + 1;
+                    entry = *it;
+                    entries_.erase(entries_.begin(), ++it);
+                }
+            }
+            pos_ = static_cast<std::streamoff>(entry.offset);
+            if (entry.flags & SegmentIndex::FLAG_RAP) {
+                pos_ = static_cast<std::streamoff>(entry.rap);
+                Logger::Trace(boost::format("%s : seek to the random access point at %lld[ms] [%s]") % log_prefix_ % (offset * idx_interval_.count()) % path.filename().string());
+            }
+        } else if (!NextOffset(pos_)) {
+            Logger::Trace(boost::format("%s : failed to read segment index (%s[ms]) [%s]") % log_prefix_ % offset_ms % path.filename().string());
+            reached_idx_end_ = true;
+            return false;
+        }
+        if (!NextOffset(next_)) {
+            Logger::Trace(boost::format("%s : failed to read segment index (%s[ms] next) [%s]") % log_prefix_ % offset_ms % path.filename().string());
+            reached_idx_end_ = true;
+            return false;
+        }
+        read_ = 0;
+        pos_ns_ = offset * 1000ll * 1000 * idx_interval_.count(); // millisec to nanosec
+        return true;
+    }
+    virtual bool NextOffset(std::streamoff& next) {
+        if (header_.version < SegmentIndex::VERSION) {
+            if (index_ >= segment_->Valid()) return false;
+            if (idx_stream_->read(reinterpret_cast<char*>(&next), sizeof(std::streamoff)).gcount() < static_cast<std::streamsize>(sizeof(std::streamoff))) return false;
+            next = idx_endian_(next);
+            ++index_;
+            return true;
+        }
+        SegmentIndex::Entry entry;
+        if (!NextEntry(entry)) return false;
+        next = static_cast<std::streamoff>(entry.offset);
+        return true;
+    }
+    virtual bool NextEntry(SegmentIndex::Entry& entry) {
+        if (entries_.empty() && !Fill()) return false;
+        entry = entries_.front();
+        entries_.pop_front();
+        return true;
+    }
+    virtual bool Fill() {
+        // reads the rest of the current block; entries are used as soon as they are complete,
+        // and the block is verified when its CRC has arrived
+        const size_t entries = static_cast<size_t>(header_.block) * header_.entry;
+        const size_t full = entries + SegmentIndex::CRC;
+        if (corrupted_) return false;
+        if (block_.size() == full) {
+            block_.clear();
+            parsed_ = 0;
+            index_ += header_.block;
+        }
+        if (index_ + parsed_ >= segment_->Valid()) return false; // the rest failed the validation
+        size_t size = block_.size();
+        block_.resize(full);
+        idx_stream_->clear(); // the index of the segment being recorded grows
+        size += static_cast<size_t>(idx_stream_->read(&block_.at(size), full - size).gcount());
+        block_.resize(size);
+        if (size == full && SegmentIndex::Get<uint32_t>(block_.data() + entries) != SegmentIndex::Crc(block_.data(), entries)) {
+            const boost::filesystem::path& path = idx_stream_ == &idx_file_ ? segment_->IdxPath() : segment_->S3KeyIdx();
+            Logger::Warning(boost::format("%s : corrupted segment index [%s]") % log_prefix_ % path.filename().string());
+            corrupted_ = true;
+            return false;
+        }
+        for (size_t complete = std::min(size, entries) / header_.entry; parsed_ < complete && index_ + parsed_ < segment_->Valid(); ++parsed_) {
+            entries_.push_back(SegmentIndex::Decode(block_.data() + parsed_ * header_.entry));
+        }
+        return !entries_.empty();
+    }
 };
 
 //----------------------------------------------------------------------------
@@ -460,6 +1036,7 @@ class LoopRec::Impl
         }
     protected:
         virtual void Thread() {
+            Affinity::Apply(Affinity::PLAYBACK);
             pimpl_->Send(sender_, option_);
             if (destruct_) return;
             boost::thread([](LoopRec::Impl* pimpl, ptr_t sender_runner) {
@@ -469,110 +1046,119 @@ class LoopRec::Impl
     };
     //----------------------------------------------------------------------------
     /// @class LoopRec::Impl::Queue
+    /// single-producer (receiving threads, one at a time under producer_mutex_) / single-consumer (recording thread) ring of packets;
+    /// a null packet closes the writer, and so does a Clear() which dropped packets
     //----------------------------------------------------------------------------
-    class Queue {
-    public:
-        class Task {
-        public:
-            Task() {}
-            virtual ~Task() {}
-            virtual void Run() = 0;
+    class Queue : private boost::noncopyable {
+        struct Slot {
+            Packet::ptr_t pkt;
+            boost::chrono::steady_clock::time_point tick;
         };
-        typedef boost::shared_ptr<Task> task_t;
-        typedef std::deque<task_t> queue_t;
-    private:
-        queue_t queue_;
+        LoopRec::Impl* pimpl_;
+        std::vector<Slot> slots_;
+        uint64_t mask_;
+        boost::atomic<uint64_t> head_;  // next slot to push (producer)
+        boost::atomic<uint64_t> tail_;  // next slot to pop (consumer)
+        boost::atomic<uint64_t> cut_;   // slots before this are dropped by the consumer
+        boost::atomic<bool> waiting_;   // the consumer is about to sleep
         boost::thread thread_;
-        mutable boost::mutex mutex_;
+        boost::mutex mutex_;
         boost::condition_variable cond_;
     public:
-        Queue() : queue_(), thread_(), mutex_(), cond_() {
+        Queue(LoopRec::Impl* pimpl) : pimpl_(pimpl), slots_(), mask_(0), head_(0), tail_(0), cut_(0), waiting_(false), thread_(), mutex_(), cond_() {
         }
         virtual ~Queue() {
             Destroy();
         }
-        virtual bool Initialize() {
+        virtual bool Initialize(size_t capacity) {
+            size_t size = 1;
+            while (size < capacity) size <<= 1;
+            slots_.assign(size, Slot());
+            mask_ = size - 1;
             thread_ = boost::thread(&Queue::Thread, this);
             return true;
         }
         virtual void Destroy() {
             if (!thread_.joinable()) return;
             thread_.interrupt();
-            cond_.notify_one();
+            {
+                boost::mutex::scoped_lock lock(mutex_);
+                cond_.notify_one();
+            }
             thread_.join();
+            slots_.clear();
         }
-        virtual bool Push(task_t task) {
-            return PushIf(0, task);
-        }
-        virtual bool PushIf(size_t limit, task_t task) {
+        virtual bool Push(const Packet::ptr_t& pkt, const boost::chrono::steady_clock::time_point& tick) {
+            // producer only; false if the ring is full
             if (!thread_.joinable()) return false;
-            boost::mutex::scoped_lock lock(mutex_);
-            if (limit > 0 && queue_.size() >= limit) return false;
-            queue_.push_back(task);
-            cond_.notify_one();
+            uint64_t head = head_.load(boost::memory_order_relaxed);
+            if (head - tail_.load(boost::memory_order_acquire) > mask_) return false;
+            Slot& slot = slots_[head & mask_];
+            slot.pkt = pkt;
+            slot.tick = tick;
+            head_.store(head + 1, boost::memory_order_seq_cst);
+            if (waiting_.load(boost::memory_order_seq_cst)) {
+                boost::mutex::scoped_lock lock(mutex_);
+                cond_.notify_one();
+            }
             return true;
         }
-        virtual void Clear() {
-            boost::mutex::scoped_lock lock(mutex_);
-            queue_.clear();
+        virtual size_t Capacity() const {
+            return slots_.size();
         }
-        template<typename Type> boost::shared_ptr<const Type> GetFirstOf() const {
-            boost::mutex::scoped_lock lock(mutex_);
-            for (queue_t::const_iterator it = queue_.begin(); it != queue_.end(); ++it) {
-                task_t ptr = *it;
-                if (!ptr || typeid(*ptr) != typeid(Type)) continue;
-                return boost::dynamic_pointer_cast<const Type>(ptr);
-            }
-            return boost::shared_ptr<const Type>();
+        virtual bool Oldest(boost::chrono::steady_clock::time_point& tick) const {
+            // producer only; the tick of the oldest packet not yet written
+            uint64_t head = head_.load(boost::memory_order_relaxed);
+            uint64_t first = std::max(tail_.load(boost::memory_order_acquire), cut_.load(boost::memory_order_relaxed));
+            if (first >= head) return false;
+            tick = slots_[first & mask_].tick;
+            return true;
         }
-    protected:
-        virtual task_t Pop() {
-            boost::mutex::scoped_lock lock(mutex_);
-            cond_.wait(lock, [this]() {
-                if (!queue_.empty()) return true;
-                boost::this_thread::interruption_point();
-                return false;
-            });
-            task_t task = queue_.front();
-            queue_.pop_front();
-            return task;
+        virtual bool Clear() {
+            // producer only; everything pushed so far is dropped (false:nothing new to drop)
+            uint64_t head = head_.load(boost::memory_order_relaxed);
+            return cut_.exchange(head, boost::memory_order_release) != head;
         }
+    protected:
         virtual void Thread() {
+            Affinity::Apply(Affinity::RECORDER);
+            bool dropped = false; // the writer has to be closed before the next packet
             try {
-                for (;;) Pop()->Run();
+                for (;;) {
+                    uint64_t tail = tail_.load(boost::memory_order_relaxed);
+                    if (tail == head_.load(boost::memory_order_acquire)) {
+                        if (dropped) pimpl_->CloseWriter();
+                        dropped = false;
+                        Wait(tail);
+                        pimpl_->Tick(boost::chrono::steady_clock::now());
+                        continue;
+                    }
+                    Slot& slot = slots_[tail & mask_];
+                    Packet::ptr_t pkt;
+                    pkt.swap(slot.pkt);
+                    boost::chrono::steady_clock::time_point tick = slot.tick;
+                    bool cut = tail < cut_.load(boost::memory_order_acquire);
+                    tail_.store(tail + 1, boost::memory_order_release); // the slot may be reused from here
+                    if (cut) {
+                        dropped = true;
+                        continue;
+                    }
+                    if (dropped || !pkt) pimpl_->CloseWriter();
+                    dropped = false;
+                    if (pkt) pimpl_->Write(*pkt, tick);
+                }
             } catch (boost::thread_interrupted&) {
             } catch (std::exception&) {
             }
         }
-    };
-    //----------------------------------------------------------------------------
-    /// @class LoopRec::Impl::WriteTask
-    //----------------------------------------------------------------------------
-    class WriteTask : public Queue::Task {
-        LoopRec::Impl* pimpl_;
-        Event::buf_t buf_;
-        boost::chrono::steady_clock::time_point tick_;
-    public:
-        WriteTask(LoopRec::Impl* pimpl, const Event::buf_t& buf, const boost::chrono::steady_clock::time_point& tick)
-            : pimpl_(pimpl), buf_(buf), tick_(tick) {
-        }
-        virtual void Run() override {
-            pimpl_->Write(buf_, tick_);
-        }
-        const boost::chrono::steady_clock::time_point& Tick() const {
-            return tick_;
-        }
-    };
-    //----------------------------------------------------------------------------
-    /// @class LoopRec::Impl::CloseWriterTask
-    //----------------------------------------------------------------------------
-    class CloseWriterTask : public Queue::Task {
-        LoopRec::Impl* pimpl_;
-    public:
-        CloseWriterTask(LoopRec::Impl* pimpl) : pimpl_(pimpl) {
-        }
-        virtual void Run() override {
-            pimpl_->CloseWriter();
+        virtual void Wait(uint64_t tail) {
+            boost::mutex::scoped_lock lock(mutex_);
+            waiting_.store(true, boost::memory_order_seq_cst);
+            if (tail == head_.load(boost::memory_order_seq_cst)) {
+                cond_.wait_for(lock, boost::chrono::milliseconds(100));
+            }
+            waiting_.store(false, boost::memory_order_relaxed);
+            boost::this_thread::interruption_point();
         }
     };
     LoopRec* owner_;
@@ -592,18 +1178,33 @@ class LoopRec::Impl
     boost::chrono::seconds total_duration_;
     boost::chrono::milliseconds idx_interval_;
     std::function<std::streampos(std::streampos)> idx_endian_;
+    int idx_version_;
+    SegmentWriter::Commit commit_;
+    double preallocate_;                        // reserved size of a segment relative to the recent bitrate (0:disabled)
+    double bitrate_;                            // bytes per sec of the recent segments
+    boost::atomic<uint64_t> segments_closed_;
+    boost::atomic<uint64_t> preallocated_;
+    boost::atomic<uint64_t> alloc_us_;
+    boost::atomic<uint64_t> alloc_max_us_;
+    boost::atomic<uint64_t> extents_;
+    boost::atomic<uint64_t> extents_max_;
+    boost::atomic<uint64_t> trimmed_;
     uint32_t prefetch_ms_;
     boost::chrono::steady_clock::time_point segment_time_;
     mutable boost::mutex mutex_;
     SenderRunner::vector_t sender_runners_;
-    Queue queue_;
+    Queue queue_;                  // single producer: pushed under producer_mutex_
+    boost::mutex producer_mutex_;  // the receiving threads of the old and the new publisher overlap while it is republished
     int queue_limit_;
+    Timer::id_t expire_timer_;
+    Timer::id_t commit_timer_;     // without queue only; the recording thread commits on its own wakeups
 public:
     Impl(LoopRec* owner, const Json& conf, const std::string& app, const std::string& name)
         : owner_(owner), conf_(conf), app_(app), name_(name), log_prefix_((boost::format("<%s> loopRec [ %s ]") % app % name).str())
         , segments_(), writer_(), dir_(), s3bucket_(), s3folder_(), s3bufsiz_(0), dat_ext_(".dat"), idx_ext_(".idx")
-        , segment_duration_(600), total_duration_(3600), idx_interval_(100), idx_endian_(), prefetch_ms_(0), segment_time_()
-        , mutex_(), sender_runners_(), queue_(), queue_limit_(0), OnReceive(), OnDisconnected() {
+        , segment_duration_(600), total_duration_(3600), idx_interval_(100), idx_endian_(), idx_version_(SegmentIndex::VERSION), commit_(), preallocate_(0), bitrate_(0)
+        , segments_closed_(0), preallocated_(0), alloc_us_(0), alloc_max_us_(0), extents_(0), extents_max_(0), trimmed_(0), prefetch_ms_(0), segment_time_()
+        , mutex_(), sender_runners_(), queue_(this), producer_mutex_(), queue_limit_(0), expire_timer_(0), commit_timer_(0), OnReceive(), OnDisconnected() {
     }
     virtual ~Impl() {
         Destroy();
@@ -629,6 +1230,12 @@ public:
             } else {
                 idx_endian_ = [](std::streamoff v) { return v; };
             }
+            idx_version_ = std::min<int>(std::max<int>(conf_["index_version"].to<int>(SegmentIndex::VERSION), 1), SegmentIndex::VERSION);
+            commit_.buffer = conf_["write_buffer"].to<size_t>(1048576);
+            commit_.interval = boost::chrono::milliseconds(conf_["commit_interval"].to<uint32_t>(1000));
+            commit_.direct = conf_["direct"].to<int>(0) != 0;
+            commit_.sync = conf_["sync"].to<int>(0) != 0;
+            preallocate_ = std::max(conf_["preallocate"].to<double>(1.2), 0.0);
             prefetch_ms_ = conf_["prefetch"].to<uint32_t>(1000);
             if (!s3bucket_.empty()) {
                 if (s3folder_.empty()) {
@@ -672,6 +1279,13 @@ public:
                         continue;
                     }
                     Segment::ptr_t segment(new Segment(log_prefix_, path, idx_ext_, s3bucket_));
+                    std::string error;
+                    uint64_t valid = 0;
+                    if (!SegmentIndex::Validate(segment->IdxPath(), segment->DatPath(), error, valid)) {
+                        // kept to expire with the others, but never played beyond the valid entries
+                        Logger::Warning(boost::format("%s : invalid segment index [%s] : %s (%llu entries played)") % log_prefix_ % segment->IdxPath().filename().string() % error % valid);
+                    }
+                    segment->SetValid(valid);
                     if (segment->Initialize()) {
                         segments_[utc] = segment;
                         segment->S3Push(s3folder_);
@@ -695,38 +1309,60 @@ public:
         }
         if (queue_limit_ == 0) {
             // write data without queue
-            OnReceive = [this](const ReceiveOption& option, const Event::buf_t& buf, bool discrete) {
+            OnReceive = [this](const ReceiveOption& option, const Packet::ptr_t& pkt, bool discrete) {
+                boost::mutex::scoped_lock lock(producer_mutex_);
                 boost::chrono::steady_clock::time_point tick = boost::chrono::steady_clock::now();
-                return Write(buf, tick);
+                return Write(*pkt, tick);
             };
             OnDisconnected = [this](const ReceiveOption& option) {
+                boost::mutex::scoped_lock lock(producer_mutex_);
                 return CloseWriter();
             };
+            // commits what a quiet publisher left in the write buffer
+            int64_t interval = std::min<int64_t>(std::max<int64_t>(commit_.interval.count(), 1), 100);
+            commit_timer_ = Timer::Schedule(interval, [this, interval]() {
+                boost::mutex::scoped_lock lock(producer_mutex_);
+                Tick(boost::chrono::steady_clock::now());
+                return interval;
+            });
         } else {
             // write data via the queue
-            OnReceive = [this](const ReceiveOption& option, const Event::buf_t& buf, bool discrete) {
+            OnReceive = [this](const ReceiveOption& option, const Packet::ptr_t& pkt, bool discrete) {
+                boost::mutex::scoped_lock lock(producer_mutex_);
                 boost::chrono::steady_clock::time_point tick = boost::chrono::steady_clock::now();
-                if (queue_limit_ <= 0) {
-                    // unlimited queuing
-                    return queue_.Push(Queue::task_t(new WriteTask(this, buf, tick)));
-                }
-                // time limited queuing in milliseconds
-                boost::shared_ptr<const WriteTask> first = queue_.GetFirstOf<WriteTask>();
-                if (first && first->Tick() + boost::chrono::milliseconds(queue_limit_) < tick) {
-                    Logger::Warning(boost::format("%s : queue overflowed : %lld[ms]") % log_prefix_ % ((tick - first->Tick()).count() / 1000 / 1000));
+                boost::chrono::steady_clock::time_point first;
+                if (queue_limit_ > 0 && queue_.Oldest(first) && first + boost::chrono::milliseconds(queue_limit_) < tick) {
+                    // time limited queuing in milliseconds
+                    Logger::Warning(boost::format("%s : queue overflowed : %lld[ms]") % log_prefix_ % ((tick - first).count() / 1000 / 1000));
                     queue_.Clear();
-                    queue_.Push(Queue::task_t(new CloseWriterTask(this)));
                 }
-                return queue_.Push(Queue::task_t(new WriteTask(this, buf, tick)));
+                if (queue_.Push(pkt, tick)) return true;
+                if (queue_.Clear()) {
+                    Logger::Warning(boost::format("%s : queue overflowed : %d packet(s)") % log_prefix_ % queue_.Capacity());
+                }
+                return queue_.Push(pkt, tick);
             };
             OnDisconnected = [this](const ReceiveOption& option) {
-                return queue_.Push(Queue::task_t(new CloseWriterTask(this)));
+                boost::mutex::scoped_lock lock(producer_mutex_);
+                if (queue_.Push(Packet::ptr_t(), boost::chrono::steady_clock::now())) return true;
+                queue_.Clear(); // closes the writer as well
+                return true;
             };
-            queue_.Initialize();
+            queue_.Initialize(std::max<size_t>(conf_["queue_capacity"].to<size_t>(65536), 2));
         }
+        // segments expire by the clock even while nothing is published
+        int64_t interval = segment_duration_.count() * 1000 / 10;
+        expire_timer_ = Timer::Schedule(interval, [this, interval]() {
+            RemoveExpiredSegments(boost::posix_time::microsec_clock::universal_time());
+            return interval;
+        });
         return true;
     }
     virtual void Destroy() {
+        Timer::Cancel(expire_timer_);
+        expire_timer_ = 0;
+        Timer::Cancel(commit_timer_);
+        commit_timer_ = 0;
         queue_.Destroy();
         sender_runners_.clear();
         writer_.reset();
@@ -739,6 +1375,18 @@ public:
         if (at + boost::posix_time::seconds(total_duration_.count()) < now || now < at) return false;
         return true;
     }
+    virtual std::string GetStatistics(const std::string& sep) const {
+        uint64_t closed = segments_closed_, preallocated = preallocated_;
+        std::stringstream ss;
+        ss << "segments:" << closed << sep;                                                // number of segments recorded and closed
+        ss << "preallocated:" << preallocated << sep;                                      // number of segments reserved in advance
+        ss << "allocAvgUs:" << (preallocated ? alloc_us_ / preallocated : 0) << sep;       // average time to reserve a segment (usec)
+        ss << "allocMaxUs:" << alloc_max_us_ << sep;                                       // longest time to reserve a segment (usec)
+        ss << "extentsAvg:" << (closed ? static_cast<double>(extents_) / closed : 0.0) << sep; // average number of extents per segment (fragmentation)
+        ss << "extentsMax:" << extents_max_ << sep;                                        // largest number of extents of a segment
+        ss << "trimmedBytes:" << trimmed_;                                                 // bytes reserved but released at the close
+        return ss.str();
+    }
     virtual void CreateSender(int sfd, const SendOption& sendOption, const StreamOption& streamOption) {
         SenderRunner::ptr_t sender_runner(new SenderRunner(this, sfd, sendOption, streamOption));
         boost::mutex::scoped_lock lock(mutex_);
@@ -746,23 +1394,23 @@ public:
         lock.unlock();
         sender_runner->Initialize();
     }
-    std::function<bool(const ReceiveOption& option, const Event::buf_t& buf, bool discrete)> OnReceive;
+    std::function<bool(const ReceiveOption& option, const Packet::ptr_t& pkt, bool discrete)> OnReceive;
     std::function<bool(const ReceiveOption& option)> OnDisconnected;
 protected:
     typedef std::pair<boost::posix_time::ptime, Segment::ptr_t> time_segment_t;
-    virtual bool Write(const Event::buf_t& buf, const boost::chrono::steady_clock::time_point& tick) {
+    virtual bool Write(const Packet& pkt, const boost::chrono::steady_clock::time_point& tick) {
         std::string suffix = "Z"; // UTC
         if (writer_ && tick >= segment_time_) {
-            writer_->Close(s3folder_);
-            writer_.reset();
+            CloseWriter();
             suffix += CONTINUOUS; // '=' means continuous data from previous segment
         }
         if (!writer_) {
             boost::posix_time::ptime utc = boost::posix_time::microsec_clock::universal_time();
-            RemoveExpiredSegments(utc);
             boost::filesystem::path path = dir_ / (boost::posix_time::to_iso_string(utc) + suffix + dat_ext_);
             Segment::ptr_t segment(new Segment(log_prefix_, path, idx_ext_, s3bucket_));
-            SegmentWriter::ptr_t writer(new SegmentWriter(log_prefix_, segment, idx_interval_, idx_endian_, tick));
+            SegmentWriter::Commit commit(commit_);
+            commit.preallocate = static_cast<int64_t>(bitrate_ * segment_duration_.count() * preallocate_);
+            SegmentWriter::ptr_t writer(new SegmentWriter(log_prefix_, segment, idx_interval_, idx_endian_, idx_version_, utc, tick, commit));
             if (segment->Initialize() && writer->Initialize()) {
                 boost::mutex::scoped_lock lock(mutex_);
                 segments_[utc] = segment;
@@ -775,28 +1423,64 @@ protected:
             }
         }
         if (writer_) {
-            writer_->Write(tick, buf);
+            writer_->Write(tick, pkt);
         }
         return true;
     }
+    virtual bool Tick(const boost::chrono::steady_clock::time_point& tick) {
+        if (writer_) writer_->Tick(tick);
+        return true;
+    }
     virtual bool CloseWriter() {
         if (writer_) {
             writer_->Close(s3folder_);
+            Account(writer_->GetReport());
             writer_.reset();
         }
         return true;
     }
+    virtual void Account(const SegmentWriter::Report& report) {
+        double sec = boost::chrono::duration_cast<boost::chrono::duration<double> >(report.elapsed).count();
+        if (sec >= 1.0) {
+            // the next segment is reserved for the bitrate of the last ones
+            double bitrate = report.written / sec;
+            bitrate_ = bitrate_ > 0 ? (bitrate_ + bitrate) / 2 : bitrate;
+        }
+        ++segments_closed_;
+        if (report.allocated > 0) {
+            ++preallocated_;
+            alloc_us_ += report.allocUs;
+            for (uint64_t max = alloc_max_us_; static_cast<uint64_t>(report.allocUs) > max && !alloc_max_us_.compare_exchange_weak(max, report.allocUs);) {}
+            if (report.allocated > report.written) trimmed_ += report.allocated - report.written;
+        }
+        if (report.extents >= 0) {
+            extents_ += report.extents;
+            for (uint64_t max = extents_max_; static_cast<uint64_t>(report.extents) > max && !extents_max_.compare_exchange_weak(max, report.extents);) {}
+        }
+    }
     virtual void RemoveExpiredSegments(const boost::posix_time::ptime& utc) {
+        // only unlinks segments under the lock; the files are removed by the janitor
         boost::posix_time::seconds dur((total_duration_ + segment_duration_).count());
-        boost::mutex::scoped_lock lock(mutex_);
-        Segment::map_t::iterator it = segments_.begin();
-        for (; it != segments_.end(); ++it) {
-            if (it->first + dur > utc) break;
-            it->second->SetExpired(true);
+        std::vector<Segment::ptr_t> expired, pushed;
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            Segment::map_t::iterator it = segments_.begin();
+            for (; it != segments_.end(); ++it) {
+                if (it->first + dur > utc) break;
+                it->second->SetExpired(true);
+                expired.push_back(it->second);
+            }
+            segments_.erase(segments_.begin(), it);
+            for (it = segments_.begin(); it != segments_.end(); ++it) {
+                if (it->second->S3Pushed() && !it->second->Deleted() && it->second->PostDelete()) pushed.push_back(it->second);
+            }
+        }
+        for (std::vector<Segment::ptr_t>::iterator it = expired.begin(); it != expired.end(); ++it) {
+            // moved so that the task holds the only reference here; Segment::Destroy() removes the files when it is released
+            Janitor::Post([segment = std::move(*it)]() {});
         }
-        segments_.erase(segments_.begin(), it);
-        for (it = segments_.begin(); it != segments_.end(); ++it) {
-            it->second->DeleteLocalIfS3Pushed();
+        for (std::vector<Segment::ptr_t>::iterator it = pushed.begin(); it != pushed.end(); ++it) {
+            Janitor::Post([segment = std::move(*it)]() { segment->DeleteLocalIfS3Pushed(); });
         }
     }
     virtual void RemoveSender(SenderRunner::ptr_t sender_runner) {
@@ -1067,8 +1751,11 @@ bool LoopRec::IsAcceptable(const StreamOption& streamOption) const {
 void LoopRec::CreateSender(int sfd, const SendOption& sendOption, const StreamOption& streamOption) {
     return pimpl_->CreateSender(sfd, sendOption, streamOption);
 }
-bool LoopRec::OnReceive(const ReceiveOption& option, const Event::buf_t& buf, bool discrete) {
-    return pimpl_->OnReceive(option, buf, discrete);
+std::string LoopRec::GetStatistics(const std::string& sep) const {
+    return pimpl_->GetStatistics(sep);
+}
+bool LoopRec::OnReceive(const ReceiveOption& option, const Packet::ptr_t& pkt, bool discrete) {
+    return pimpl_->OnReceive(option, pkt, discrete);
 }
 bool LoopRec::OnDisconnected(const ReceiveOption& option) {
     return pimpl_->OnDisconnected(option);
@@ -17,7 +17,8 @@ public:
     virtual void Destroy();
     virtual bool IsAcceptable(const StreamOption& streamOption) const;
     virtual void CreateSender(int sfd, const SendOption& sendOption, const StreamOption& streamOption);
+    virtual std::string GetStatistics(const std::string& sep = ", ") const;
 protected:
-    virtual bool OnReceive(const ReceiveOption& option, const Event::buf_t& buf, bool discrete) override;
+    virtual bool OnReceive(const ReceiveOption& option, const Packet::ptr_t& pkt, bool discrete) override;
     virtual bool OnDisconnected(const ReceiveOption& option) override;
 };
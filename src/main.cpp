@@ -5,6 +5,13 @@
 #include "listener.h"
 #include "receiver.h"
 #include "sender.h"
+#include "fanout.h"
+#include "reactor.h"
+#include "affinity.h"
+#include "auth.h"
+#include "timer.h"
+#include "janitor.h"
+#include "access.h"
 #include "looprec.h"
 #include "aws.h"
 
@@ -17,29 +24,61 @@
 //----------------------------------------------------------------------------
 class ReflectSender : public Event, private boost::noncopyable {
     Sender::ptr_t sender_;
+    Fanout::Queue::ptr_t queue_;
     std::string app_;
     std::string name_;
     std::string peer_;
 protected:
-    ReflectSender(int sfd, const SendOption& option) : Event(), sender_(Sender::Create(sfd, option)) {
+    ReflectSender(int sfd, const SendOption& option) : Event(), sender_(Sender::Create(sfd, option)), queue_() {
         app_ = option.Get<std::string>("app");
         name_ = option.Get<std::string>("name");
         peer_ = option.Get<std::string>("peer");
+        Sender::ptr_t sender(sender_);
+        std::string label = (boost::format("<%s> [%s] for %s") % app_ % name_ % peer_).str();
+        queue_ = Fanout::CreateQueue(option, label, [sender](const Packet& pkt) {
+            return sender->TrySend(pkt);
+        }, sfd);
+    }
+    virtual bool Initialize() {
+        // applies the socket options, above all "sndsyn=0" so that a full send buffer never blocks a fanout worker
+        if (sender_->Initialize()) return true;
+        Logger::Warning(boost::format("<%s> failed to initialize sender [%s] for %s : %s") % app_ % name_ % peer_ % sender_->GetErrMsg());
+        return false;
     }
 public:
     static Event::ptr_t Create(int sfd, const SendOption& option) {
-        return Event::ptr_t(new ReflectSender(sfd, option));
+        boost::shared_ptr<ReflectSender> sender(new ReflectSender(sfd, option));
+        if (!sender->Initialize()) return Event::ptr_t();
+        return sender;
     }
     virtual ~ReflectSender() {
+        if (queue_) {
+            queue_->Close();
+            if (queue_->Dropped() > 0 || queue_->Decisions() > 0) {
+                Logger::Info(boost::format("<%s> send queue overflowed [%s] for %s : %llu decision(s), %llu packet(s) dropped")
+                    % app_ % name_ % peer_ % queue_->Decisions() % queue_->Dropped());
+            }
+            queue_.reset();
+        }
         sender_.reset();
     }
 protected:
-    bool OnReceive(const ReceiveOption& option, const Event::buf_t& buf, bool discrete) override {
-        if (!sender_) return false;
-        if (sender_->Send(buf)) return true;
+    bool OnCache(const ReceiveOption& option, const Packet::vector_t& cache) override {
+        if (!queue_) return false;
+        if (!queue_->Prime(cache)) return false;
+        Logger::Debug(boost::format("<%s> cache sent [%s] for %s : %d packet(s)") % app_ % name_ % peer_ % cache.size());
+        return true;
+    }
+    bool OnReceive(const ReceiveOption& option, const Packet::ptr_t& pkt, bool discrete) override {
+        if (!queue_) return false;
+        if (queue_->Push(pkt)) return true;
         std::string err = sender_->GetErrMsg();
-        sender_.reset();
-        Logger::Info(boost::format("<%s> send failed [%s] for %s : %s") % app_ % name_ % peer_ % err);
+        queue_->Close();
+        if (err.empty()) {
+            Logger::Info(boost::format("<%s> player given up [%s] for %s") % app_ % name_ % peer_);
+        } else {
+            Logger::Info(boost::format("<%s> send failed [%s] for %s : %s") % app_ % name_ % peer_ % err);
+        }
         return false;
     }
 };
@@ -49,40 +88,296 @@ protected:
 //----------------------------------------------------------------------------
 class Reflect : public Event, public boost::enable_shared_from_this<Reflect>, private boost::noncopyable
 {
-    class Cache {
-        typedef boost::tuple<std::chrono::steady_clock::time_point, CURLcode, Json> data_t;
-        typedef std::map<std::string, data_t> map_t;
-        map_t map_;
+    class Cache : private boost::noncopyable {
+        // webhook results in shards of least recently used lists
+        typedef boost::tuple<std::string, std::chrono::steady_clock::time_point, CURLcode, Json> data_t;
+        typedef std::list<data_t> list_t;
+        typedef std::unordered_map<std::string, list_t::iterator> map_t;
+        struct Shard {
+            boost::mutex mutex;
+            list_t list; // most recently used first
+            map_t map;
+        };
+        typedef boost::shared_ptr<Shard> shard_t;
+        std::vector<shard_t> shards_;
+        size_t limit_;    // entries per shard
+        int32_t allow_;   // sec to keep allowed results
+        int32_t deny_;    // sec to keep denied results
+        std::vector<std::string> ignore_; // body fields excluded from the key
+        boost::atomic<uint64_t> hits_;
+        boost::atomic<uint64_t> misses_;
+        boost::atomic<uint64_t> expired_;
+        boost::atomic<uint64_t> evicted_;
     public:
-        Cache() : map_() {}
-        CURLcode find(boost::mutex& mutex, const std::string& key, Json& body) const {
-            boost::mutex::scoped_lock lock(mutex);
-            map_t::const_iterator it = map_.find(key);
-            if (it == map_.end()) return CURL_LAST;
-            if (std::chrono::steady_clock::now() > it->second.get<0>()) return CURL_LAST;
-            body = it->second.get<2>();
-            return it->second.get<1>();
-        }
-        void set(boost::mutex& mutex, const std::string& key, CURLcode code, const Json& body, int32_t age) {
-            boost::mutex::scoped_lock lock(mutex);
-            map_[key] = boost::make_tuple(std::chrono::steady_clock::now() + std::chrono::seconds(age), code, body);
+        Cache(const Json& conf) : shards_(), limit_(0), allow_(0), deny_(0), ignore_(), hits_(0), misses_(0), expired_(0), evicted_(0) {
+            allow_ = conf["cacheAge"].to<int32_t>(10);
+            deny_ = conf["cacheDenyAge"].to<int32_t>(allow_);
+            size_t shards = std::max<size_t>(conf["cacheShards"].to<size_t>(8), 1);
+            limit_ = std::max<size_t>(conf["cacheSize"].to<size_t>(4096) / shards, 1);
+            for (size_t i = 0; i < shards; ++i) {
+                shards_.push_back(shard_t(new Shard()));
+            }
+            Json::Node ignore = conf["cacheIgnore"];
+            for (size_t i = 0, c = ignore.size(); i < c; ++i) {
+                ignore_.push_back(ignore[i].to<std::string>());
+            }
+        }
+        std::string key(const std::string& uri, const Json& body) const {
+            if (ignore_.empty()) return (boost::format("%s:%s") % uri % body.serialize()).str();
+            Json normalized = body;
+            for (std::vector<std::string>::const_iterator it = ignore_.begin(); it != ignore_.end(); ++it) {
+                // "addr" or "streamid.<key>"
+                std::string::size_type dot = it->find('.');
+                if (dot == std::string::npos) {
+                    normalized.remove(*it);
+                } else {
+                    normalized[it->substr(0, dot)].remove(it->substr(dot + 1));
+                }
+            }
+            return (boost::format("%s:%s") % uri % normalized.serialize()).str();
+        }
+        CURLcode find(const std::string& key, Json& body) {
+            Shard& shard = *shards_[std::hash<std::string>()(key) % shards_.size()];
+            boost::mutex::scoped_lock lock(shard.mutex);
+            map_t::iterator it = shard.map.find(key);
+            if (it == shard.map.end()) {
+                ++misses_;
+                return CURL_LAST;
+            }
+            if (std::chrono::steady_clock::now() > it->second->get<1>()) {
+                shard.list.erase(it->second);
+                shard.map.erase(it);
+                ++expired_;
+                ++misses_;
+                return CURL_LAST;
+            }
+            shard.list.splice(shard.list.begin(), shard.list, it->second);
+            ++hits_;
+            body = it->second->get<3>();
+            return it->second->get<2>();
+        }
+        void purge() {
+            // remove expired entries which nobody asks for again
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            for (std::vector<shard_t>::const_iterator it = shards_.begin(); it != shards_.end(); ++it) {
+                Shard& shard = **it;
+                boost::mutex::scoped_lock lock(shard.mutex);
+                for (list_t::iterator data = shard.list.begin(); data != shard.list.end();) {
+                    if (now > data->get<1>()) {
+                        shard.map.erase(data->get<0>());
+                        data = shard.list.erase(data);
+                        ++expired_;
+                    } else {
+                        ++data;
+                    }
+                }
+            }
+        }
+        int32_t age(CURLcode code) const {
+            // sec to keep a result of code (0:not cached)
+            return std::max(code == CURLE_OK ? allow_ : deny_, 0);
+        }
+        int32_t age() const {
+            // the shortest age in sec (0:nothing is cached)
+            if (allow_ <= 0 || deny_ <= 0) return std::max(std::max(allow_, deny_), 0);
+            return std::min(allow_, deny_);
+        }
+        void set(const std::string& key, CURLcode code, const Json& body) {
+            int32_t age = code == CURLE_OK ? allow_ : deny_;
+            if (age <= 0) return;
+            std::chrono::steady_clock::time_point expire = std::chrono::steady_clock::now() + std::chrono::seconds(age);
+            Shard& shard = *shards_[std::hash<std::string>()(key) % shards_.size()];
+            boost::mutex::scoped_lock lock(shard.mutex);
+            map_t::iterator it = shard.map.find(key);
+            if (it != shard.map.end()) {
+                *it->second = boost::make_tuple(key, expire, code, body);
+                shard.list.splice(shard.list.begin(), shard.list, it->second);
+                return;
+            }
+            shard.list.push_front(boost::make_tuple(key, expire, code, body));
+            shard.map[key] = shard.list.begin();
+            if (shard.list.size() > limit_) {
+                shard.map.erase(shard.list.back().get<0>());
+                shard.list.pop_back();
+                ++evicted_;
+            }
+        }
+        std::string GetStatistics(const std::string& sep) {
+            size_t size = 0;
+            for (std::vector<shard_t>::const_iterator it = shards_.begin(); it != shards_.end(); ++it) {
+                boost::mutex::scoped_lock lock((*it)->mutex);
+                size += (*it)->list.size();
+            }
+            std::stringstream ss;
+            ss << "cacheHits:" << hits_ << sep;       // number of webhook results found in the cache
+            ss << "cacheMisses:" << misses_ << sep;   // number of lookups not found or expired
+            ss << "cacheExpired:" << expired_ << sep; // number of entries removed after their age
+            ss << "cacheEvicted:" << evicted_ << sep; // number of least recently used entries removed for the size
+            ss << "cacheSize:" << size;               // number of entries
+            return ss.str();
+        }
+    };
+    class Registry : private boost::noncopyable {
+        // receivers by name in stripes, each behind its own lock
+        static const size_t STRIPES = 16;
+    public:
+        typedef std::function<Receiver::ptr_t()> factory_t; // the receiver to register (null:none)
+    private:
+        struct Stripe {
+            boost::mutex mutex;
+            Receiver::map_t map;
+            std::map<std::string, uint64_t> orphans; // receivers waiting for their publisher by the generation
+        };
+        class Lock : private boost::noncopyable {
+            // scoped lock which records the wait and the hold time
+            Registry& registry_;
+            boost::mutex::scoped_lock lock_;
+            boost::chrono::steady_clock::time_point locked_;
+        public:
+            Lock(Registry& registry, Stripe& stripe) : registry_(registry), lock_(stripe.mutex, boost::defer_lock), locked_() {
+                if (!lock_.try_lock()) {
+                    ++registry_.contended_;
+                    lock_.lock();
+                }
+                locked_ = boost::chrono::steady_clock::now();
+            }
+            ~Lock() {
+                uint64_t us = boost::chrono::duration_cast<boost::chrono::microseconds>(boost::chrono::steady_clock::now() - locked_).count();
+                lock_.unlock();
+                ++registry_.locks_;
+                registry_.holdUs_ += us;
+                for (uint64_t max = registry_.holdMaxUs_; us > max && !registry_.holdMaxUs_.compare_exchange_weak(max, us);) {}
+            }
+        };
+        Stripe stripes_[STRIPES];
+        boost::atomic<uint64_t> generation_;
+        boost::atomic<uint64_t> locks_;
+        boost::atomic<uint64_t> contended_;
+        boost::atomic<uint64_t> holdUs_;
+        boost::atomic<uint64_t> holdMaxUs_;
+        Stripe& stripe(const std::string& name) {
+            return stripes_[std::hash<std::string>()(name) % STRIPES];
+        }
+    public:
+        Registry() : generation_(0), locks_(0), contended_(0), holdUs_(0), holdMaxUs_(0) {
+        }
+        Receiver::ptr_t find(const std::string& name) {
+            Stripe& s = stripe(name);
+            Lock lock(*this, s);
+            Receiver::map_t::const_iterator it = s.map.find(name);
+            return it == s.map.end() ? Receiver::ptr_t() : it->second;
+        }
+        Receiver::ptr_t remove(const std::string& name) {
+            Receiver::ptr_t receiver;
+            Stripe& s = stripe(name);
+            Lock lock(*this, s);
+            Receiver::map_t::iterator it = s.map.find(name);
+            if (it != s.map.end()) {
+                receiver.swap(it->second);
+                s.map.erase(it);
+            }
+            s.orphans.erase(name);
+            return receiver;
+        }
+        uint64_t orphan(const std::string& name) {
+            // keeps the receiver and its players for a reconnecting publisher (0:not registered)
+            Stripe& s = stripe(name);
+            Lock lock(*this, s);
+            if (s.map.find(name) == s.map.end()) return 0;
+            uint64_t generation = ++generation_;
+            s.orphans[name] = generation;
+            return generation;
+        }
+        bool orphaned(const std::string& name) {
+            Stripe& s = stripe(name);
+            Lock lock(*this, s);
+            return s.orphans.find(name) != s.orphans.end();
+        }
+        Receiver::ptr_t claimOrInsert(const std::string& name, const factory_t& factory, bool& claimed) {
+            // the orphaned receiver (claimed) or factory() registered unless the name is published; decided under one lock
+            // the factory only constructs; the caller reattaches or initializes the result without the lock
+            claimed = false;
+            Stripe& s = stripe(name);
+            Lock lock(*this, s);
+            Receiver::map_t::iterator it = s.map.find(name);
+            std::map<std::string, uint64_t>::iterator orphan = s.orphans.find(name);
+            if (it != s.map.end()) {
+                if (orphan == s.orphans.end()) return Receiver::ptr_t(); // already exists
+                s.orphans.erase(orphan); // not expired any more; published by the caller from now on
+                claimed = true;
+                return it->second;
+            }
+            s.orphans.erase(name);
+            Receiver::ptr_t receiver = factory();
+            if (receiver) s.map[name] = receiver;
+            return receiver;
+        }
+        Receiver::ptr_t remove(const std::string& name, const Receiver::ptr_t& receiver) {
+            // rolls back claimOrInsert() unless the name has been replaced since
+            Stripe& s = stripe(name);
+            Lock lock(*this, s);
+            Receiver::map_t::iterator it = s.map.find(name);
+            if (it == s.map.end() || it->second != receiver) return Receiver::ptr_t();
+            s.map.erase(it);
+            s.orphans.erase(name);
+            return receiver;
+        }
+        Receiver::ptr_t expire(const std::string& name, uint64_t generation) {
+            // removes the receiver if nobody has claimed it since it was orphaned
+            Receiver::ptr_t receiver;
+            Stripe& s = stripe(name);
+            Lock lock(*this, s);
+            std::map<std::string, uint64_t>::iterator it = s.orphans.find(name);
+            if (it == s.orphans.end() || it->second != generation) return receiver;
+            s.orphans.erase(it);
+            Receiver::map_t::iterator found = s.map.find(name);
+            if (found != s.map.end()) {
+                receiver.swap(found->second);
+                s.map.erase(found);
+            }
+            return receiver;
+        }
+        Receiver::map_t snapshot() {
+            // copied stripe by stripe; the receivers are used after the locks are released
+            Receiver::map_t map;
+            for (size_t i = 0; i < STRIPES; ++i) {
+                Lock lock(*this, stripes_[i]);
+                map.insert(stripes_[i].map.begin(), stripes_[i].map.end());
+            }
+            return map;
+        }
+        void clear() {
+            for (size_t i = 0; i < STRIPES; ++i) {
+                Receiver::map_t map;
+                {
+                    Lock lock(*this, stripes_[i]);
+                    map.swap(stripes_[i].map);
+                    stripes_[i].orphans.clear();
+                }
+            }
+        }
+        std::string GetStatistics(const std::string& sep) {
+            uint64_t locks = locks_;
+            std::stringstream ss;
+            ss << "registryLocks:" << locks << sep;                                   // number of times a stripe was locked
+            ss << "registryContended:" << contended_ << sep;                          // number of locks which had to wait
+            ss << "registryHoldAvgUs:" << (locks ? holdUs_ / locks : 0) << sep;       // average time a stripe was held (usec)
+            ss << "registryHoldMaxUs:" << holdMaxUs_;                                 // longest time a stripe was held (usec)
+            return ss.str();
         }
     };
     const Json conf_;
     mutable Cache cache_;
+    std::map<std::string, Access::ptr_t> access_; // compiled "access" of "publish" and "play"
     Listener::ptr_t listener_;
-    Receiver::map_t receivers_;
+    mutable Registry receivers_;
     LoopRec::map_t loopRecs_;
-    mutable boost::mutex mutex_;
-    int32_t stats_;
-    std::chrono::steady_clock::time_point stats_time_;
+    std::vector<Timer::id_t> timers_;
 protected:
-    Reflect(const Json& conf) : Event(), conf_(conf), cache_(), listener_(), receivers_(), loopRecs_(), mutex_(), stats_(0), stats_time_() {
+    Reflect(const Json& conf) : Event(), conf_(conf), cache_(conf_), access_(), listener_(), receivers_(), loopRecs_(), timers_() {
     }
     Receiver::ptr_t FindReceiver(const std::string& name) const {
-        boost::mutex::scoped_lock lock(mutex_);
-        const Receiver::map_t::const_iterator it = receivers_.find(name);
-        return it == receivers_.end() ? Receiver::ptr_t() : it->second;
+        return receivers_.find(name);
     }
 public:
     typedef boost::shared_ptr<Reflect> ptr_t;
@@ -94,14 +389,22 @@ public:
         Destroy();
     }
     virtual bool Initialize() {
-        stats_ = conf_["publish"]["stats"].to<int32_t>(0);
-        stats_time_ = std::chrono::steady_clock::now() + std::chrono::seconds(stats_);
         loopRecs_ = LoopRec::Create(conf_["loopRecs"], app());
+        access_["publish"] = Access::Create(conf_["publish"]["access"]);
+        access_["play"] = Access::Create(conf_["play"]["access"]);
         ListenOption opt;
         opt["host"] = conf_["host"].to<std::string>();
         opt["port"] = conf_["port"].to<std::string>();
         opt["backlog"] = conf_["backlog"].to<std::string>("10");
-        opt["epolltimeo"] = conf_["epolltimeo"].to<std::string>("100");
+        opt["shards"] = conf_["shards"].to<std::string>("1");
+        opt["ratelimit"] = conf_["admission"]["rate"].to<std::string>("0");
+        opt["rateburst"] = conf_["admission"]["burst"].to<std::string>("10");
+        opt["prefixlimit"] = conf_["admission"]["prefixrate"].to<std::string>("0");
+        opt["prefixburst"] = conf_["admission"]["prefixburst"].to<std::string>("50");
+        opt["prefixlen4"] = conf_["admission"]["prefix4"].to<std::string>("24");
+        opt["prefixlen6"] = conf_["admission"]["prefix6"].to<std::string>("48");
+        opt["maxhandshakes"] = conf_["admission"]["handshakes"].to<std::string>("0");
+        opt["maxsessions"] = conf_["admission"]["sessions"].to<std::string>("0");
         opt.SetSockOpts(conf_["option"], ListenOption::s_sockopts_pre_bind); // "pre-bind" options
         Listener::ptr_t listener(Listener::Create(opt));
         if (!listener->Initialize()) {
@@ -111,9 +414,21 @@ public:
         listener->AddEvent(shared_from_this(), 0, false);
         listener_.swap(listener);
         Logger::Info(boost::format("<%s> listen %s:%s") % app() % opt["host"] % opt["port"]);
+        int64_t stats = conf_["publish"]["stats"].to<int32_t>(0) * 1000ll;
+        if (stats > 0) {
+            timers_.push_back(Timer::Schedule(stats, [this, stats]() { PrintStatistics(); return stats; }));
+        }
+        int64_t age = cache_.age() * 1000ll;
+        if (age > 0) {
+            timers_.push_back(Timer::Schedule(age, [this, age]() { cache_.purge(); return age; }));
+        }
         return true;
     }
     virtual void Destroy() {
+        for (std::vector<Timer::id_t>::const_iterator it = timers_.begin(); it != timers_.end(); ++it) {
+            Timer::Cancel(*it);
+        }
+        timers_.clear();
         listener_.reset();
         receivers_.clear();
         loopRecs_.clear();
@@ -122,60 +437,44 @@ public:
         return conf_["app"].to<std::string>("live");
     }
 protected:
-    typedef std::pair<bool, Json> res_t;
-    virtual bool PatternMatch(std::string pattern, const std::string& str) const {
-        try {
-            static const std::string escape = "\\+.?^$-|/{}()[]";
-            for (size_t i = 0, c = escape.length(); i < c; ++i) {
-                std::string esc = escape.substr(i, 1);
-                boost::algorithm::replace_all(pattern, esc, "\\" + esc);
+    typedef std::pair<CURLcode, Json> res_t;
+    virtual bool AccessCheck(const std::string& call, const SockAddr& addr, const StreamOption& streamOption) const {
+        std::map<std::string, Access::ptr_t>::const_iterator it = access_.find(call);
+        if (it == access_.end()) return true;
+        int rule = -1;
+        if (!it->second->Check(addr, streamOption.ResourceName(), &rule)) {
+            if (Logger::DebugEnabled()) {
+                Logger::Debug(boost::format("<%s> access denied: [ %s ] [ %s ] : %s")
+                    % app() % addr.ToString() % streamOption(',', '=') % conf_[call]["access"][rule].serialize());
             }
-            boost::algorithm::replace_all(pattern, "*", ".*");
-            boost::algorithm::replace_all(pattern, "%", ".");
-            boost::xpressive::sregex regex = boost::xpressive::sregex::compile("^" + pattern + "$");
-            return boost::xpressive::regex_match(str, regex);
-        } catch (boost::xpressive::regex_error&) {
             return false;
         }
-    }
-    virtual bool AccessCheck(const Json::Node& access, const SockAddr& addr, const StreamOption& streamOption) const {
-        for (size_t i = 0, c = access.size(); i < c; ++i) {
-            std::string name = access[i]["name"].to<std::string>("*");
-            if (!name.empty() && name != "*" && !PatternMatch(name, streamOption.ResourceName())) {
-                continue;
-            }
-            std::string deny = access[i]["deny"].to<std::string>();
-            if (!deny.empty()) {
-                if (deny == "*" || boost::iequals(deny, "all") || addr.Match(deny)) {
-                    if (Logger::DebugEnabled()) {
-                        Logger::Debug(boost::format("<%s> access denied: [ %s ] [ %s ] : %s")
-                            % app() % addr.ToString() % streamOption(',', '=') % access[i].serialize());
-                    }
-                    return false;
-                }
-            }
-            std::string allow = access[i]["allow"].to<std::string>();
-            if (!allow.empty()) {
-                if (allow == "*" || boost::iequals(allow, "all") || addr.Match(allow)) {
-                    if (Logger::TraceEnabled()) {
-                        Logger::Trace(boost::format("<%s> access allowed: [ %s ] [ %s ] : %s")
-                            % app() % addr.ToString() % streamOption(',', '=') % access[i].serialize());
-                    }
-                    return true;
-                }
-            }
+        if (rule >= 0 && Logger::TraceEnabled()) {
+            Logger::Trace(boost::format("<%s> access allowed: [ %s ] [ %s ] : %s")
+                % app() % addr.ToString() % streamOption(',', '=') % conf_[call]["access"][rule].serialize());
         }
         return true;
     }
-    virtual CURLcode Perform(const std::string& uri, Json& body, const SockAddr& addr, const StreamOption& streamOption) const {
-        std::string key = (boost::format("%s:%s") % uri % body.serialize()).str();
-        CURLcode res = cache_.find(mutex_, key, body);
+    virtual CURLcode Perform(const std::string& uri, Json& body, const SockAddr& addr, const StreamOption& streamOption, int32_t wait) const {
+        std::string key = cache_.key(uri, body);
+        CURLcode res = cache_.find(key, body);
         if (res != CURL_LAST) return res;
-        Curl curl;
+        // concurrent callers with the same cache key wait for one webhook call;
+        // the decision is reused no longer than the cache would keep it, unless a caller is retrying
+        boost::shared_ptr<const Reflect> thiz(shared_from_this());
+        return Auth::Decide(key, [thiz, key, uri, addr, streamOption](Json& body) {
+            return thiz->Request(key, uri, body, addr, streamOption);
+        }, [thiz](CURLcode res) {
+            return thiz->cache_.age(res) * 1000;
+        }, body, wait);
+    }
+    virtual CURLcode Request(const std::string& key, const std::string& uri, Json& body, const SockAddr& addr, const StreamOption& streamOption) const {
+        CurlPool::Lease curl(uri);
         CurlJsonIO io(curl);
         io.Reset(5, body);
         curl_easy_setopt(io, CURLOPT_URL, uri.c_str());
-        res = curl_easy_perform(io);
+        CURLcode res = curl_easy_perform(io);
+        curl.Done(res);
         if (res == CURLE_OK) {
             body = io.Json();
             if (Logger::TraceEnabled()) {
@@ -193,13 +492,13 @@ protected:
                     % app() % addr.ToString() % streamOption(',', '=') % uri % code % io.Body() % io.Error());
             }
         }
-        cache_.set(mutex_, key, res, body, conf_["cacheAge"].to<int32_t>(10));
+        cache_.set(key, res, body);
         return res;
     }
-    virtual res_t Authorize(const std::string& on, const std::string& call, const SockAddr& addr, const StreamOption& streamOption) const {
-        if (on == "on_pre_accept" && !AccessCheck(conf_[call]["access"], addr, streamOption)) return std::make_pair(false, Json());
+    virtual res_t Authorize(const std::string& on, const std::string& call, const SockAddr& addr, const StreamOption& streamOption, int32_t wait = -1) const {
+        if (on == "on_pre_accept" && !AccessCheck(call, addr, streamOption)) return std::make_pair(CURLE_REMOTE_ACCESS_DENIED, Json());
         std::string uri = conf_[call][on].to<std::string>();
-        if (uri.empty()) return std::make_pair(true, Json());
+        if (uri.empty()) return std::make_pair(CURLE_OK, Json());
         Json body;
         body["app"] = app().c_str();
         body["name"] = streamOption.ResourceName().c_str();
@@ -210,8 +509,18 @@ protected:
         for (URIOption::map_t::const_iterator it = map.begin(); it != map.end(); ++it) {
             body["streamid"][it->first] = it->second.c_str();
         }
-        CURLcode res = Perform(uri, body, addr, streamOption);
-        return std::make_pair(res == CURLE_OK, body);
+        CURLcode res = Perform(uri, body, addr, streamOption, wait);
+        return std::make_pair(res, body);
+    }
+    virtual bool Defer(int sfd, const std::string& call, const SockAddr& peer, const StreamOption& streamOption) const {
+        // the webhook has not answered yet; the decision is kept for the caller's next attempt
+        if (Logger::DebugEnabled()) {
+            Logger::Debug(boost::format("<%s> access deferred: [ %s ] [ %s ] : %s") % app() % peer.ToString() % streamOption(',', '=') % call);
+        }
+#if SRT_VERSION_VALUE >= SRT_MAKE_VERSION_VALUE(1,4,2)
+        srt_setrejectreason(sfd, SRT_REJX_DOWN);
+#endif
+        return false;
     }
     virtual bool OnPreAccept(ListenOption& option, int sfd, const SockAddr& peer, const StreamOption& streamOption) override {
         std::string name = streamOption.ResourceName();
@@ -221,9 +530,10 @@ protected:
             return false;
         } else if (streamOption.Mode() == "publish") {
             Receiver::ptr_t receiver = FindReceiver(name);
-            if (receiver) return false; // already exists
-            res_t res = Authorize("on_pre_accept", "publish", peer, streamOption);
-            if (!res.first) return false;
+            if (receiver && !receivers_.orphaned(name)) return false; // already exists
+            res_t res = Authorize("on_pre_accept", "publish", peer, streamOption, Auth::Wait());
+            if (res.first == CURLE_AGAIN) return Defer(sfd, "publish", peer, streamOption);
+            if (res.first != CURLE_OK) return false;
             option.SetSockOpts(conf_["option"], ListenOption::s_sockopts_pre); // "pre" options
             option.SetSockOpts(conf_["publish"]["option"], ListenOption::s_sockopts_pre);
             option.SetSockOpts(res.second["option"], ListenOption::s_sockopts_pre);
@@ -237,8 +547,9 @@ protected:
                 Receiver::ptr_t receiver = FindReceiver(name);
                 if (!receiver) return false; // not exists
             }
-            res_t res = Authorize("on_pre_accept", "play", peer, streamOption);
-            if (!res.first) return false;
+            res_t res = Authorize("on_pre_accept", "play", peer, streamOption, Auth::Wait());
+            if (res.first == CURLE_AGAIN) return Defer(sfd, "play", peer, streamOption);
+            if (res.first != CURLE_OK) return false;
             option.SetSockOpts(conf_["option"], ListenOption::s_sockopts_pre); // "pre" options
             option.SetSockOpts(conf_["play"]["option"], ListenOption::s_sockopts_pre);
             option.SetSockOpts(res.second["option"], ListenOption::s_sockopts_pre);
@@ -253,34 +564,56 @@ protected:
             return false;
         } else if (streamOption.Mode() == "publish") {
             Receiver::ptr_t receiver = FindReceiver(name);
-            if (receiver) return false; // already exists
+            if (receiver && !receivers_.orphaned(name)) return false; // already exists
             ReceiveOption opt;
             opt["name"] = name;
             opt["peer"] = peer.ToString();
-            res_t res = Authorize("on_accept", "publish", peer, streamOption);
-            if (!res.first) return false;
+            opt["drainms"] = conf_["publish"]["drainms"].to<std::string>("5");
+            opt["drainbytes"] = conf_["publish"]["drainbytes"].to<std::string>("1048576");
+            opt["coalesce"] = conf_["play"]["coalesce"].to<std::string>("0");
+            opt["cache"] = conf_["play"]["cache"].to<std::string>("0");
+            res_t res = Authorize("on_accept", "publish", peer, streamOption, Auth::AcceptWait());
+            if (res.first != CURLE_OK) return false;
             opt.SetSockOpts(conf_["option"], ReceiveOption::s_sockopts); // "post" options
             opt.SetSockOpts(conf_["publish"]["option"], ReceiveOption::s_sockopts);
             opt.SetSockOpts(res.second["option"], ReceiveOption::s_sockopts);
-            receiver = Receiver::Create(sfd, opt);
-            if (!receiver->Initialize()) {
+            bool resumed = false;
+            receiver = receivers_.claimOrInsert(name, [this, &name, &opt, sfd]() {
+                Receiver::ptr_t receiver = Receiver::Create(sfd, opt);
+                receiver->AddEvent(shared_from_this(), 0);
+                LoopRec::map_t::const_iterator loopRec = loopRecs_.find(name);
+                if (loopRec != loopRecs_.end() && loopRec->second) receiver->AddEvent(loopRec->second, -1);
+                return receiver;
+            }, resumed);
+            if (!receiver) return false;
+            // without the registry lock: Reattach() joins the previous receiving thread
+            if (resumed) {
+                // within the grace period; the players stay subscribed
+                if (!receiver->Reattach(sfd)) {
+                    Logger::Error(boost::format("<%s> Receiver::Reattach error: %s") % app() % receiver->GetErrMsg());
+                    Release(receivers_.remove(name, receiver));
+                    return false;
+                }
+            } else if (!receiver->Initialize()) {
                 Logger::Error(boost::format("<%s> Receiver::Initialize error: %s") % app() % receiver->GetErrMsg());
+                Release(receivers_.remove(name, receiver));
                 return false;
             }
-            receiver->AddEvent(shared_from_this(), 0);
-            LoopRec::map_t::const_iterator loopRec = loopRecs_.find(name);
-            if (loopRec != loopRecs_.end() && loopRec->second) receiver->AddEvent(loopRec->second, -1);
-            boost::mutex::scoped_lock lock(mutex_);
-            receivers_[name] = receiver;
-            Logger::Info(boost::format("<%s> accept publish [ %s ] from %s") % app() % name % opt["peer"]);
+            Logger::Info(boost::format("<%s> %s publish [ %s ] from %s") % app() % (resumed ? "resume" : "accept") % name % opt["peer"]);
             return true;
         } else { // "request"
             SendOption opt;
             opt["app"] = app();
             opt["name"] = name;
             opt["peer"] = peer.ToString();
-            res_t res = Authorize("on_accept", "play", peer, streamOption);
-            if (!res.first) return false;
+            opt["queue"] = conf_["play"]["queue"].to<std::string>("1024");
+            opt["queuebytes"] = conf_["play"]["queuebytes"].to<std::string>("0");
+            opt["maxdelay"] = conf_["play"]["maxdelay"].to<std::string>("0");
+            opt["policy"] = conf_["play"]["policy"].to<std::string>("drop-new");
+            opt["srctime"] = conf_["play"]["srctime"].to<std::string>("1");
+            opt["burst"] = conf_["play"]["burst"].to<std::string>("0");
+            res_t res = Authorize("on_accept", "play", peer, streamOption, Auth::AcceptWait());
+            if (res.first != CURLE_OK) return false;
             opt.SetSockOpts(conf_["option"], SendOption::s_sockopts); // "post" options
             opt.SetSockOpts(conf_["play"]["option"], SendOption::s_sockopts);
             opt.SetSockOpts(res.second["option"], SendOption::s_sockopts);
@@ -292,39 +625,66 @@ protected:
                 Receiver::ptr_t receiver = FindReceiver(name);
                 if (!receiver) return false; // not exists
                 Event::ptr_t sender(ReflectSender::Create(sfd, opt));
+                if (!sender) return false;
                 receiver->AddEvent(sender, 0, true);
             }
             Logger::Info(boost::format("<%s> accept request [ %s ] from %s") % app() % name % opt["peer"]);
             return true;
         }
     }
-    virtual bool OnListenerFlag(const ListenOption& option) override {
-        boost::mutex::scoped_lock lock(mutex_);
-        for (Receiver::map_t::const_iterator it = receivers_.begin(); it != receivers_.end(); ++it) {
-            Receiver::ptr_t receiver = it->second;
-            if (!it->second) continue;
-            std::string name = receiver->GetOption().Get<std::string>("name");
-            std::string stats = receiver->GetStatistics(1, ", ");
-            Logger::Info(boost::format("<%s> stats receive [ %s ] : %s") % app() % name % stats);
+    virtual void PrintStatistics() const {
+        // called on the timer thread every "stats" sec
+        // formatted without holding the registry
+        const Receiver::map_t receivers = receivers_.snapshot();
+        for (Receiver::map_t::const_iterator it = receivers.begin(); it != receivers.end(); ++it) {
+            std::string stats = it->second->GetStatistics(1, ", ");
+            Logger::Info(boost::format("<%s> stats receive [ %s ] : %s") % app() % it->first % stats);
         }
-        stats_time_ += std::chrono::seconds(stats_);
-        return false;
-    }
-    virtual bool GetListenerFlag() const override {
-        return stats_ > 0 && std::chrono::steady_clock::now() > stats_time_;
+        for (LoopRec::map_t::const_iterator it = loopRecs_.begin(); it != loopRecs_.end(); ++it) {
+            Logger::Info(boost::format("<%s> stats loopRec [ %s ] : %s") % app() % it->first % it->second->GetStatistics());
+        }
+        Listener::ptr_t listener = listener_;
+        if (listener) Logger::Info(boost::format("<%s> stats listen : %s") % app() % listener->GetStatistics());
+        Logger::Info(boost::format("<%s> stats packet : %s") % app() % Packet::GetStatistics());
+        Logger::Info(boost::format("<%s> stats fanout : %s") % app() % Fanout::GetStatistics());
+        Logger::Info(boost::format("<%s> stats webhook : %s") % app() % CurlPool::GetStatistics());
+        std::string auth = Auth::GetStatistics();
+        if (!auth.empty()) Logger::Info(boost::format("<%s> stats auth : %s") % app() % auth);
+        Logger::Info(boost::format("<%s> stats auth cache : %s") % app() % cache_.GetStatistics(", "));
+        Logger::Info(boost::format("<%s> stats timer : %s") % app() % Timer::GetStatistics());
+        Logger::Info(boost::format("<%s> stats janitor : %s") % app() % Janitor::GetStatistics());
+        Logger::Info(boost::format("<%s> stats registry : %s") % app() % receivers_.GetStatistics(", "));
     }
     virtual bool OnDisconnected(const ReceiveOption& option) override {
         std::string name = option.Get<std::string>("name");
         std::string peer = option.Get<std::string>("peer");
         Logger::Info(boost::format("<%s> disconnected [ %s ] from %s") % app() % name % peer);
-        boost::mutex::scoped_lock lock(mutex_);
-        Receiver::map_t::iterator it = receivers_.find(name);;
-        if (it != receivers_.end() && it->second) {
-            boost::thread([](Receiver::ptr_t receiver) { receiver.reset(); }, it->second);
-            it->second.reset();
+        int32_t grace = conf_["publish"]["grace"].to<int32_t>(0);
+        uint64_t generation = grace > 0 ? receivers_.orphan(name) : 0;
+        if (generation) {
+            boost::weak_ptr<Reflect> wthiz(shared_from_this());
+            Timer::Schedule(grace * 1000ll, [wthiz, name, generation]() {
+                ptr_t thiz = wthiz.lock();
+                if (thiz) thiz->Expire(name, generation);
+                return 0;
+            });
+            Logger::Info(boost::format("<%s> waiting %d sec for the publisher [ %s ]") % app() % grace % name);
+            return true;
         }
+        Release(receivers_.remove(name));
         return true;
     }
+protected:
+    virtual void Expire(const std::string& name, uint64_t generation) {
+        Receiver::ptr_t receiver = receivers_.expire(name, generation);
+        if (!receiver) return; // resumed
+        Logger::Info(boost::format("<%s> publisher not returned [ %s ]") % app() % name);
+        Release(receiver);
+    }
+    static void Release(const Receiver::ptr_t& receiver) {
+        // not on the receiving thread which is joined by the destructor
+        if (receiver) boost::thread([](Receiver::ptr_t receiver) { receiver.reset(); }, receiver);
+    }
 };
 
 //----------------------------------------------------------------------------
@@ -363,6 +723,7 @@ public:
         Logger::Debug(boost::format("conf: %s") % conf_.serialize(2));
         CurlGlobal::SetUserAgent(name_.c_str());
         CurlGlobal::SetCertificateAuthority(conf_["cainfo"].to<boost::filesystem::path>().string().c_str());
+        CurlPool::SetPoolSize(conf_["webhook"]["pool"].to<size_t>(4), conf_["webhook"]["idle"].to<long>(60));
         if (srt_startup() == SRT_ERROR) {
             Logger::Fatal(boost::format("ERROR: srt_startup failed : %s") % srt_getlasterror_str());
             return false;
@@ -392,10 +753,43 @@ public:
             //AWS::Test();
             //return false;
         }
+        Affinity::Init(conf_["affinity"]);
+        if (!Timer::Init(conf_["timer"])) {
+            Logger::Fatal(boost::format("ERROR: Timer::Init failed"));
+            return false;
+        }
+        if (!Janitor::Init(conf_["janitor"])) {
+            Logger::Fatal(boost::format("ERROR: Janitor::Init failed"));
+            return false;
+        }
+        Packet::Init(conf_["packet"]);
+        if (!Fanout::Init(conf_["fanout"])) {
+            Logger::Fatal(boost::format("ERROR: Fanout::Init failed"));
+            return false;
+        }
+        if (!Reactor::Init(conf_["reactor"])) {
+            Logger::Fatal(boost::format("ERROR: Reactor::Init failed"));
+            return false;
+        }
+        if (!Auth::Init(conf_["auth"])) {
+            Logger::Fatal(boost::format("ERROR: Auth::Init failed"));
+            return false;
+        }
         return true;
     }
     virtual void Destroy() {
+        for (Reflect::vector_t::iterator it = reflects_.begin(); it != reflects_.end(); ++it) {
+            (*it)->Destroy(); // stop listener and receivers before the subsystems below
+        }
         reflects_.clear();
+        Auth::Term();
+        Timer::Term();
+        Janitor::Term();
+        CurlPool::Clear();
+        Reactor::Term();
+        Fanout::Term();
+        Packet::Term();
+        Affinity::Term();
         srt_cleanup();
         if (conf_["aws"]["enabled"].to<int>(0)) {
             AWS::Term();
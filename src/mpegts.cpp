@@ -0,0 +1,119 @@
+﻿#include "stdafx.h"
+#include "mpegts.h"
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+bool MpegTs::Pcr(const char* data, size_t size, uint64_t& pcr) {
+    for (size_t offset = 0; offset + PACKET_SIZE <= size; offset += PACKET_SIZE) {
+        const uint8_t* ts = reinterpret_cast<const uint8_t*>(data + offset);
+        if (ts[0] != SYNC_BYTE) break; // not a TS payload
+        if ((ts[3] & 0x20) && ts[4] >= 7 && (ts[5] & 0x10)) { // PCR_flag
+            uint64_t base = (static_cast<uint64_t>(ts[6]) << 25) | (ts[7] << 17) | (ts[8] << 9) | (ts[9] << 1) | (ts[10] >> 7);
+            uint64_t ext = ((ts[10] & 0x01) << 8) | ts[11];
+            pcr = base * 300 + ext;
+            return true;
+        }
+    }
+    return false;
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+uint32_t MpegTs::Parser::Inspect(const char* data, size_t size) {
+    uint32_t flags = 0;
+    for (size_t offset = 0; offset + PACKET_SIZE <= size; offset += PACKET_SIZE) {
+        const uint8_t* ts = reinterpret_cast<const uint8_t*>(data + offset);
+        if (ts[0] != SYNC_BYTE) break; // not a TS payload
+        uint16_t pid = Pid(data + offset);
+        if (pid == 0) {
+            flags |= PAT;
+            ParsePat(ts);
+        } else if (std::find(pmts_.begin(), pmts_.end(), pid) != pmts_.end()) {
+            flags |= PMT;
+            ParsePmt(ts, pid);
+        }
+        // common muxers set random_access_indicator on every audio PES as well
+        if ((ts[3] & 0x20) && ts[4] > 0 && (ts[5] & 0x40) && IsVideo(pid)) {
+            flags |= RAI;
+        }
+    }
+    return flags;
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+bool MpegTs::Parser::IsVideo(uint16_t pid) const {
+    if (!pmt_) return false; // not decodable before the PMT
+    if (videos_.empty()) return true; // without video (e.g. audio only)
+    return std::find_if(videos_.begin(), videos_.end(), [pid](const std::pair<uint16_t, uint16_t>& v) { return v.second == pid; }) != videos_.end();
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+bool MpegTs::Parser::IsVideoType(uint8_t type) {
+    switch (type) {
+    case 0x01: // MPEG-1 video
+    case 0x02: // MPEG-2 video
+    case 0x10: // MPEG-4 part 2
+    case 0x1b: // H.264/AVC
+    case 0x20: // H.264/MVC
+    case 0x24: // H.265/HEVC
+    case 0x33: // H.266/VVC
+    case 0x42: // AVS
+    case 0xea: // VC-1
+        return true;
+    default:
+        return false;
+    }
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+void MpegTs::Parser::ParsePat(const uint8_t* ts) {
+    if ((ts[1] & 0x40) == 0) return; // payload_unit_start_indicator
+    if ((ts[3] & 0x10) == 0) return; // no payload
+    size_t pos = 4;
+    if (ts[3] & 0x20) pos += 1 + ts[4]; // adaptation field
+    if (pos >= PACKET_SIZE) return;
+    pos += 1 + ts[pos]; // pointer_field
+    if (pos + 8 > PACKET_SIZE || ts[pos] != 0x00) return; // table_id
+    size_t length = ((ts[pos + 1] & 0x0f) << 8) | ts[pos + 2];
+    size_t end = std::min(pos + 3 + length, static_cast<size_t>(PACKET_SIZE));
+    if (end < pos + 12) return;
+    end -= 4; // CRC_32
+    pmts_.clear();
+    for (size_t i = pos + 8; i + 4 <= end; i += 4) {
+        uint16_t program = static_cast<uint16_t>((ts[i] << 8) | ts[i + 1]);
+        if (program == 0) continue; // network PID
+        pmts_.push_back(static_cast<uint16_t>(((ts[i + 2] & 0x1f) << 8) | ts[i + 3]));
+    }
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+void MpegTs::Parser::ParsePmt(const uint8_t* ts, uint16_t pid) {
+    // only a PMT which fits in one TS packet, as the PAT
+    if ((ts[1] & 0x40) == 0) return; // payload_unit_start_indicator
+    if ((ts[3] & 0x10) == 0) return; // no payload
+    size_t pos = 4;
+    if (ts[3] & 0x20) pos += 1 + ts[4]; // adaptation field
+    if (pos >= PACKET_SIZE) return;
+    pos += 1 + ts[pos]; // pointer_field
+    if (pos + 12 > PACKET_SIZE || ts[pos] != 0x02) return; // table_id
+    size_t length = ((ts[pos + 1] & 0x0f) << 8) | ts[pos + 2];
+    size_t end = pos + 3 + length;
+    if (end > PACKET_SIZE || end < pos + 16) return;
+    end -= 4; // CRC_32
+    size_t i = pos + 12 + (((ts[pos + 10] & 0x0f) << 8) | ts[pos + 11]); // program_info
+    videos_.erase(std::remove_if(videos_.begin(), videos_.end(), [pid](const std::pair<uint16_t, uint16_t>& v) { return v.first == pid; }), videos_.end());
+    for (; i + 5 <= end; i += 5 + (((ts[i + 3] & 0x0f) << 8) | ts[i + 4])) {
+        if (IsVideoType(ts[i])) videos_.push_back(std::make_pair(pid, static_cast<uint16_t>(((ts[i + 1] & 0x1f) << 8) | ts[i + 2])));
+    }
+    pmt_ = true;
+}
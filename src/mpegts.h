@@ -0,0 +1,37 @@
+﻿#pragma once
+
+//----------------------------------------------------------------------------
+/// @class MpegTs
+/// minimal inspection of MPEG-TS packets carried in SRT messages
+//----------------------------------------------------------------------------
+class MpegTs
+{
+public:
+    static const size_t PACKET_SIZE = 188;
+    static const uint8_t SYNC_BYTE = 0x47;
+    enum {
+        RAI = 0x01, // random_access_indicator on a video PID (any PID of a stream without video)
+        PAT = 0x02, // program association table
+        PMT = 0x04  // program map table of a program listed in the last PAT
+    };
+    static uint16_t Pid(const char* ts) { return static_cast<uint16_t>(((ts[1] & 0x1f) << 8) | (ts[2] & 0xff)); }
+    static bool Pcr(const char* data, size_t size, uint64_t& pcr); // program_clock_reference (27MHz) of the first TS packet carrying one
+
+    //------------------------------------------------------------------------
+    /// @class MpegTs::Parser
+    /// per-stream state to recognize the PMT pids and the video elementary pids
+    //------------------------------------------------------------------------
+    class Parser {
+        std::vector<uint16_t> pmts_;
+        std::vector<std::pair<uint16_t, uint16_t> > videos_; // (PMT pid, video elementary pid)
+        bool pmt_;                                           // a PMT has been parsed
+    public:
+        Parser() : pmts_(), videos_(), pmt_(false) {}
+        uint32_t Inspect(const char* data, size_t size); // RAI | PAT | PMT of the TS packets in data
+    protected:
+        void ParsePat(const uint8_t* ts);
+        void ParsePmt(const uint8_t* ts, uint16_t pid);
+        bool IsVideo(uint16_t pid) const;
+        static bool IsVideoType(uint8_t type);
+    };
+};
@@ -0,0 +1,128 @@
+﻿#include "stdafx.h"
+#include "packet.h"
+
+//----------------------------------------------------------------------------
+/// @class Packet::Pool
+/// free list of packets; heap allocation happens only when the list is empty
+//----------------------------------------------------------------------------
+class Packet::Pool : private boost::noncopyable
+{
+    boost::mutex mutex_;
+    Packet* free_;
+    size_t pooled_;
+    size_t limit_;
+    boost::atomic<uint64_t> allocated_;
+    boost::atomic<uint64_t> created_;
+    boost::atomic<int64_t> used_;
+public:
+    Pool() : mutex_(), free_(nullptr), pooled_(0), limit_(16384), allocated_(0), created_(0), used_(0) {
+    }
+    ~Pool() {
+        Clear();
+    }
+    void SetLimit(size_t limit, size_t prealloc) {
+        boost::mutex::scoped_lock lock(mutex_);
+        limit_ = limit;
+        for (; pooled_ < std::min(prealloc, limit_); ++pooled_) {
+            Packet* p = new Packet();
+            ++allocated_;
+            p->next_ = free_;
+            free_ = p;
+        }
+    }
+    Packet* Get() {
+        ++created_;
+        ++used_;
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            if (free_) {
+                Packet* p = free_;
+                free_ = p->next_;
+                --pooled_;
+                p->next_ = nullptr;
+                p->size_ = 0;
+                p->flags_ = 0;
+                p->srctime_ = 0;
+                p->boundary_ = 0;
+                p->seq_ = 0;
+                return p;
+            }
+        }
+        ++allocated_;
+        return new Packet();
+    }
+    void Put(Packet* p) {
+        --used_;
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            if (pooled_ < limit_) {
+                p->next_ = free_;
+                free_ = p;
+                ++pooled_;
+                return;
+            }
+        }
+        delete p;
+    }
+    void Clear() {
+        boost::mutex::scoped_lock lock(mutex_);
+        while (free_) {
+            Packet* p = free_;
+            free_ = p->next_;
+            delete p;
+        }
+        pooled_ = 0;
+    }
+    std::string GetStatistics(const std::string& sep) {
+        boost::mutex::scoped_lock lock(mutex_);
+        std::stringstream ss;
+        ss << "packetCreated:" << created_ << sep;    // number of packets handed out by the pool
+        ss << "packetAllocated:" << allocated_ << sep; // number of heap allocations for packets
+        ss << "packetUsed:" << used_ << sep;          // number of packets currently referenced
+        ss << "packetPooled:" << pooled_;             // number of packets waiting in the free list
+        return ss.str();
+    }
+};
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+Packet::Pool Packet::pool_;
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+Packet::mutable_ptr_t Packet::Create() {
+    return mutable_ptr_t(pool_.Get());
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+void Packet::Init(const Json::Node& conf) {
+    pool_.SetLimit(conf["pool"].to<size_t>(16384), conf["prealloc"].to<size_t>(0));
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+void Packet::Term() {
+    pool_.Clear();
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+std::string Packet::GetStatistics(const std::string& sep) {
+    return pool_.GetStatistics(sep);
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+void intrusive_ptr_release(const Packet* p) {
+    if (p->refs_.fetch_sub(1, boost::memory_order_release) == 1) {
+        boost::atomic_thread_fence(boost::memory_order_acquire);
+        Packet::pool_.Put(const_cast<Packet*>(p));
+    }
+}
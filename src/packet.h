@@ -0,0 +1,57 @@
+﻿#pragma once
+
+#include "json.h"
+
+//----------------------------------------------------------------------------
+/// @class Packet
+/// pooled, reference-counted payload which is filled once by the receiver
+/// and shared read-only by every consumer
+//----------------------------------------------------------------------------
+class Packet : private boost::noncopyable
+{
+    class Pool;
+    static Pool pool_;
+    mutable boost::atomic<int32_t> refs_;
+    Packet* next_; // link in the free list
+    size_t size_;
+    uint32_t flags_;
+    boost::chrono::steady_clock::time_point tick_; // when the packet was received
+    int64_t srctime_;                               // SRT_MSGCTRL::srctime (0:unknown)
+    int boundary_;                                  // SRT_MSGCTRL::boundary
+    uint64_t seq_;                                  // delivery order within the stream
+    char data_[1500];
+    Packet() : refs_(0), next_(nullptr), size_(0), flags_(0), tick_(), srctime_(0), boundary_(0), seq_(0) {}
+    ~Packet() {}
+public:
+    typedef boost::intrusive_ptr<const Packet> ptr_t;
+    typedef boost::intrusive_ptr<Packet> mutable_ptr_t;
+    typedef std::vector<ptr_t> vector_t;
+    static const size_t CAPACITY = sizeof(data_);
+    enum {
+        FLAG_RAP = 0x01, // contains a random access point (see:MpegTs::Parser)
+        FLAG_PAT = 0x02, // contains a PAT
+        FLAG_PMT = 0x04, // contains a PMT
+    };
+    static mutable_ptr_t Create();
+    static void Init(const Json::Node& conf);
+    static void Term();
+    static std::string GetStatistics(const std::string& sep = ", ");
+    char* Data() { return data_; }
+    const char* Data() const { return data_; }
+    size_t Size() const { return size_; }
+    bool Empty() const { return size_ == 0; }
+    void Resize(size_t size) { size_ = std::min(size, CAPACITY); }
+    uint32_t Flags() const { return flags_; }
+    void SetFlags(uint32_t flags) { flags_ = flags; }
+    bool IsRandomAccess() const { return (flags_ & FLAG_RAP) != 0; }
+    const boost::chrono::steady_clock::time_point& Tick() const { return tick_; }
+    void SetTick(const boost::chrono::steady_clock::time_point& tick) { tick_ = tick; }
+    int64_t SrcTime() const { return srctime_; }
+    void SetSrcTime(int64_t srctime) { srctime_ = srctime; }
+    int Boundary() const { return boundary_; }
+    void SetBoundary(int boundary) { boundary_ = boundary; }
+    uint64_t Seq() const { return seq_; }
+    void SetSeq(uint64_t seq) { seq_ = seq; }
+    friend void intrusive_ptr_add_ref(const Packet* p) { p->refs_.fetch_add(1, boost::memory_order_relaxed); }
+    friend void intrusive_ptr_release(const Packet* p);
+};
@@ -0,0 +1,209 @@
+﻿#include "stdafx.h"
+#include "reactor.h"
+#include "logger.h"
+#include "affinity.h"
+
+//----------------------------------------------------------------------------
+/// @class Reactor::Worker
+//----------------------------------------------------------------------------
+class Reactor::Worker : private boost::noncopyable
+{
+    struct Entry {
+        ready_t ready;
+        tick_t tick;
+        boost::recursive_mutex mutex; // held while dispatching; recursive for Remove() from the callback
+        bool removed;
+        Entry(const ready_t& ready, const tick_t& tick) : ready(ready), tick(tick), mutex(), removed(false) {}
+    };
+    typedef boost::shared_ptr<Entry> entry_t;
+    typedef std::map<SRTSOCKET, entry_t> map_t;
+    const int msTimeout_;
+    int eid_;
+    map_t entries_;
+    mutable boost::mutex mutex_;
+    boost::thread thread_;
+public:
+    Worker(int msTimeout) : msTimeout_(msTimeout), eid_(-1), entries_(), mutex_(), thread_() {
+    }
+    virtual ~Worker() {
+        Destroy();
+    }
+    virtual bool Initialize() {
+        eid_ = srt_epoll_create();
+        if (eid_ < 0) {
+            Logger::Error(boost::format("reactor : failed srt_epoll_create(): %s") % srt_getlasterror_str());
+            return false;
+        }
+        srt_epoll_set(eid_, SRT_EPOLL_ENABLE_EMPTY); // keep waiting while no socket is registered
+        thread_ = boost::thread(&Worker::Thread, this);
+        return true;
+    }
+    virtual void Destroy() {
+        if (thread_.joinable()) {
+            thread_.interrupt();
+            thread_.join();
+        }
+        if (eid_ >= 0) {
+            srt_epoll_release(eid_);
+            eid_ = -1;
+        }
+        boost::mutex::scoped_lock lock(mutex_);
+        entries_.clear();
+    }
+    virtual size_t Size() const {
+        boost::mutex::scoped_lock lock(mutex_);
+        return entries_.size();
+    }
+    virtual bool Add(SRTSOCKET sfd, const ready_t& ready, const tick_t& tick) {
+        boost::mutex::scoped_lock lock(mutex_);
+        entries_[sfd] = entry_t(new Entry(ready, tick));
+        int events = SRT_EPOLL_IN | SRT_EPOLL_ERR;
+        if (srt_epoll_add_usock(eid_, sfd, &events) == SRT_ERROR) {
+            entries_.erase(sfd);
+            return false;
+        }
+        return true;
+    }
+    virtual bool Remove(SRTSOCKET sfd) {
+        entry_t entry;
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            map_t::iterator it = entries_.find(sfd);
+            if (it == entries_.end()) return false;
+            entry = it->second;
+            entries_.erase(it);
+        }
+        srt_epoll_remove_usock(eid_, sfd);
+        boost::recursive_mutex::scoped_lock lock(entry->mutex); // wait for the running callback
+        if (entry->removed) return false;
+        entry->removed = true;
+        return true;
+    }
+protected:
+    virtual entry_t Find(SRTSOCKET sfd) const {
+        boost::mutex::scoped_lock lock(mutex_);
+        map_t::const_iterator it = entries_.find(sfd);
+        return it == entries_.end() ? entry_t() : it->second;
+    }
+    virtual void Dispatch(SRTSOCKET sfd) {
+        entry_t entry = Find(sfd);
+        if (!entry) return;
+        boost::recursive_mutex::scoped_lock lock(entry->mutex);
+        if (entry->removed) return;
+        if (entry->ready()) return;
+        entry->removed = true;
+        srt_epoll_remove_usock(eid_, sfd);
+        boost::mutex::scoped_lock lk(mutex_);
+        map_t::iterator it = entries_.find(sfd);
+        if (it != entries_.end() && it->second == entry) entries_.erase(it);
+    }
+    virtual void Tick() {
+        std::vector<entry_t> entries;
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            entries.reserve(entries_.size());
+            for (map_t::const_iterator it = entries_.begin(); it != entries_.end(); ++it) {
+                entries.push_back(it->second);
+            }
+        }
+        for (std::vector<entry_t>::const_iterator it = entries.begin(); it != entries.end(); ++it) {
+            boost::recursive_mutex::scoped_lock lock((*it)->mutex);
+            if (!(*it)->removed) (*it)->tick();
+        }
+    }
+    virtual void Thread() {
+        Affinity::Apply(Affinity::RECEIVER);
+        std::vector<SRTSOCKET> srtrfds(256, SRT_INVALID_SOCK);
+        boost::chrono::steady_clock::time_point tick = boost::chrono::steady_clock::now();
+        for (;;) {
+            try {
+                for (;; boost::this_thread::interruption_point()) {
+                    int srtrfdslen = static_cast<int>(srtrfds.size());
+                    int n = srt_epoll_wait(eid_, &srtrfds.at(0), &srtrfdslen, 0, 0, msTimeout_, 0, 0, 0, 0);
+                    for (int i = 0; i < n; ++i) {
+                        Dispatch(srtrfds[i]);
+                    }
+                    boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now();
+                    if (now >= tick) {
+                        Tick();
+                        tick = now + boost::chrono::milliseconds(msTimeout_);
+                    }
+                }
+            } catch (boost::thread_interrupted&) {
+                return;
+            } catch (std::exception& ex) {
+                Logger::Error(boost::format("reactor : an unexpected exception occurred: %s") % ex.what());
+            }
+        }
+    }
+};
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+Reactor::workers_t Reactor::workers_;
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+bool Reactor::Init(const Json::Node& conf) {
+    if (!workers_.empty()) return true;
+    size_t threads = conf["threads"].to<size_t>(0);
+    if (threads == 0) {
+        Logger::Info("reactor : one thread per publisher");
+        return true;
+    }
+    int msTimeout = conf["epolltimeo"].to<int>(100);
+    for (size_t i = 0; i < threads; ++i) {
+        pworker_t worker(new Worker(msTimeout));
+        if (!worker->Initialize()) {
+            workers_.clear();
+            return false;
+        }
+        workers_.push_back(worker);
+    }
+    Logger::Info(boost::format("reactor : %d epoll thread(s)") % threads);
+    return true;
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+void Reactor::Term() {
+    workers_.clear();
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+size_t Reactor::Threads() {
+    return workers_.size();
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+bool Reactor::Add(int sfd, const ready_t& ready, const tick_t& tick) {
+    if (workers_.empty()) return false;
+    // the least loaded worker takes the new socket
+    pworker_t worker = workers_.front();
+    size_t size = worker->Size();
+    for (workers_t::const_iterator it = workers_.begin() + 1; it != workers_.end(); ++it) {
+        size_t n = (*it)->Size();
+        if (n < size) {
+            worker = *it;
+            size = n;
+        }
+    }
+    return worker->Add(static_cast<SRTSOCKET>(sfd), ready, tick);
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+bool Reactor::Remove(int sfd) {
+    for (workers_t::const_iterator it = workers_.begin(); it != workers_.end(); ++it) {
+        if ((*it)->Remove(static_cast<SRTSOCKET>(sfd))) return true;
+    }
+    return false;
+}
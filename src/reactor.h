@@ -0,0 +1,23 @@
+﻿#pragma once
+
+#include "json.h"
+
+//----------------------------------------------------------------------------
+/// @class Reactor
+/// a fixed set of srt epoll threads shared by all receiver sockets
+//----------------------------------------------------------------------------
+class Reactor
+{
+    class Worker;
+    typedef boost::shared_ptr<Worker> pworker_t;
+    typedef std::vector<pworker_t> workers_t;
+    static workers_t workers_;
+public:
+    typedef std::function<bool()> ready_t; // false to unregister the socket
+    typedef std::function<void()> tick_t;  // called every epoll timeout on the same thread
+    static bool Init(const Json::Node& conf);
+    static void Term();
+    static size_t Threads();
+    static bool Add(int sfd, const ready_t& ready, const tick_t& tick);
+    static bool Remove(int sfd); // waits for the running callback; false if already unregistered
+};
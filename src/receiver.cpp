@@ -1,6 +1,9 @@
 ﻿#include "stdafx.h"
 #include "receiver.h"
 #include "messages.h"
+#include "reactor.h"
+#include "mpegts.h"
+#include "affinity.h"
 
 //----------------------------------------------------------------------------
 /// @class Reciver::Impl
@@ -12,13 +15,38 @@ class Receiver::Impl
     const ReceiveOption option_;
     int eid_;
     boost::thread thread_;
-    boost::mutex mutex_;
-    Event::list_t events_;
-    Event::vector_t own_events_;
+    SRTSOCKET reactor_; // registered with the shared reactor instead of the own thread
+    boost::atomic<bool> running_;
+    SRT_MSGCTRL msgctrl_;
+    const size_t drainBytes_;                   // byte budget per wakeup (0:unlimited)
+    const boost::chrono::milliseconds drainMs_; // time budget per wakeup (0:unlimited)
+    static const size_t BATCH_BUCKETS = 8;      // 1, 2-3, 4-7, ... , 128 and more messages per wakeup
+    boost::atomic<uint64_t> batches_[BATCH_BUCKETS];
+    boost::atomic<uint64_t> budgetHits_;
+    static const size_t COALESCE_SIZE = 7 * MpegTs::PACKET_SIZE; // live payload size
+    const boost::chrono::milliseconds coalesceMs_;               // flush deadline of small TS messages (0:disabled)
+    Packet::mutable_ptr_t pending_;
+    bool pendingDiscrete_;
+    boost::chrono::steady_clock::time_point pendingDeadline_;
+    MpegTs::Parser parser_;
+    uint64_t seq_;
+    const size_t cacheBytes_;  // GOP cache for new players (0:disabled)
+    boost::mutex cacheMutex_;
+    Packet::vector_t cache_;   // from the last random access point
+    size_t cacheSize_;
+    Packet::ptr_t pat_;
+    Packet::ptr_t pmt_;
+    Event::Set events_;
+    Event::Set::Reader reader_; // used only on the receiving thread (or the reactor thread)
     SafeMessages errmsgs_;
 public:
     Impl(Receiver* owner, SRTSOCKET sfd, const ReceiveOption& option)
-        : owner_(owner), sfd_(sfd), option_(option), eid_(-1), thread_(), mutex_(), events_(), own_events_(), errmsgs_() {
+        : owner_(owner), sfd_(sfd), option_(option), eid_(-1), thread_(), reactor_(SRT_INVALID_SOCK), running_(false), msgctrl_(),
+        drainBytes_(option.Get<size_t>("drainbytes", 1048576)), drainMs_(option.Get<int>("drainms", 5)), budgetHits_(0),
+        coalesceMs_(option.Get<int>("coalesce", 0)), pending_(), pendingDiscrete_(false), pendingDeadline_(),
+        parser_(), seq_(0), cacheBytes_(option.Get<size_t>("cache", 0)), cacheMutex_(), cache_(), cacheSize_(0), pat_(), pmt_(),
+        events_(), reader_(events_), errmsgs_() {
+        for (size_t i = 0; i < BATCH_BUCKETS; ++i) batches_[i] = 0;
     }
     virtual ~Impl() {
         Destroy();
@@ -28,15 +56,10 @@ public:
             errmsgs_ << "invalid socket.";
             return false;
         }
-        if (thread_.joinable()) {
+        if (thread_.joinable() || reactor_ != SRT_INVALID_SOCK) {
             errmsgs_ << "already running.";
             return false;
         }
-        eid_ = srt_epoll_create();
-        if (eid_ < 0) {
-            errmsgs_ << boost::format("failed srt_epoll_create(): %s") % srt_getlasterror_str();
-            return false;
-        }
         if (option_.Has("maxbw")) {
             int64_t maxbw = option_.Get<int64_t>("maxbw", -1);
             if (srt_setsockflag(sfd_, SRTO_MAXBW, &maxbw, sizeof(maxbw)) == SRT_ERROR) {
@@ -95,16 +118,48 @@ public:
                 return false;
             }
         }
+        srt_msgctrl_init(&msgctrl_);
+        {
+            // Receive() drains until SRT_EASYNCRCV; a blocking read on the emptied socket would stall the budgets,
+            // the coalescing deadline and the flags (and a shared reactor thread must never block in srt_recvmsg2())
+            bool rcvsyn = false;
+            if (srt_setsockflag(sfd_, SRTO_RCVSYN, &rcvsyn, sizeof(rcvsyn)) == SRT_ERROR) {
+                errmsgs_ << boost::format("failed srt_setsockflag(SRTO_RCVSYN) [ false ]; %s") % srt_getlasterror_str();
+                return false;
+            }
+        }
+        if (Reactor::Threads() > 0) {
+            running_ = true;
+            if (!Reactor::Add(sfd_, [this]() { return Ready(); }, [this]() { Tick(); })) {
+                running_ = false;
+                errmsgs_ << boost::format("failed srt_epoll_add_usock(): %s") % srt_getlasterror_str();
+                return false;
+            }
+            reactor_ = sfd_;
+            return true;
+        }
+        eid_ = srt_epoll_create();
+        if (eid_ < 0) {
+            errmsgs_ << boost::format("failed srt_epoll_create(): %s") % srt_getlasterror_str();
+            return false;
+        }
         int events = SRT_EPOLL_IN | SRT_EPOLL_ERR;
         if (srt_epoll_add_usock(eid_, sfd_, &events) == SRT_ERROR) {
             errmsgs_ << boost::format("failed srt_epoll_add_usock(): %s") % srt_getlasterror_str();
             return false;
         }
         //TRACE(_T("MESRT::Receiver::Impl::Initialize [ %s ] streamName=%s\n"), A4T(option_.Get<std::string>("peername", "")).c_str(), A4T(option_.Get<std::string>("streamname", "")).c_str());
+        running_ = true;
         thread_ = boost::thread(&Impl::Thread, this);
         return true;
     }
     virtual void Destroy() {
+        running_ = false;
+        if (reactor_ != SRT_INVALID_SOCK) {
+            SRTSOCKET sfd = reactor_;
+            reactor_ = SRT_INVALID_SOCK;
+            if (Reactor::Remove(sfd)) ThreadExit(); // not yet unregistered by a disconnection
+        }
         if (eid_ >= 0) {
             int eid = eid_;
             eid_ = -1;
@@ -119,18 +174,58 @@ public:
             srt_close(sfd_);
             sfd_ = SRT_INVALID_SOCK;
         }
-        own_events_.clear();
+        reader_.Reset();
+        events_.Clear();
+    }
+    virtual bool Reattach(SRTSOCKET sfd) {
+        if (sfd_ != SRT_INVALID_SOCK) {
+            errmsgs_ << "still connected.";
+            return false;
+        }
+        // the receiving thread (or the reactor callback) has already returned from Disconnected()
+        running_ = false;
+        if (reactor_ != SRT_INVALID_SOCK) {
+            SRTSOCKET old = reactor_;
+            reactor_ = SRT_INVALID_SOCK;
+            Reactor::Remove(old); // waits for the callback which reported the disconnection
+        }
+        if (eid_ >= 0) {
+            int eid = eid_;
+            eid_ = -1;
+            srt_epoll_release(eid);
+        }
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+        {
+            // the cached GOP belongs to the previous connection
+            boost::mutex::scoped_lock lk(cacheMutex_);
+            cache_.clear();
+            cacheSize_ = 0;
+            pat_.reset();
+            pmt_.reset();
+        }
+        parser_ = MpegTs::Parser();
+        sfd_ = sfd;
+        return Initialize();
     }
     virtual void AddEvent(Event::wptr_t ev, int priority, bool own) {
-        Event::AddEvent(mutex_, events_, ev, priority);
-        if (!own) return;
         Event::ptr_t p = ev.lock();
-        if (!p) return;
-        boost::mutex::scoped_lock lk(mutex_);
-        own_events_.push_back(p);
-    }
-    virtual Event::vector_t GetEvents() {
-        return Event::GetEvents(mutex_, events_);
+        if (cacheBytes_ == 0 || !p) {
+            events_.Add(ev, priority, own);
+            return;
+        }
+        // hand over the cache and subscribe atomically; the subscriber skips live packets up to the last cached Seq()
+        boost::mutex::scoped_lock lk(cacheMutex_);
+        if (!cache_.empty()) {
+            Packet::vector_t cache;
+            cache.reserve(cache_.size() + 2);
+            if (pat_ && pat_->Seq() < cache_.front()->Seq()) cache.push_back(pat_);
+            if (pmt_ && pmt_->Seq() < cache_.front()->Seq()) cache.push_back(pmt_);
+            cache.insert(cache.end(), cache_.begin(), cache_.end());
+            p->OnCache(option_, cache);
+        }
+        events_.Add(ev, priority, own);
     }
     virtual const ReceiveOption& GetOption() const {
         return option_;
@@ -248,11 +343,16 @@ public:
 #undef COMMON
 #undef SNDR_O
 #undef RCVR_O
+        for (size_t i = 0; i < BATCH_BUCKETS; ++i) {
+            ss << "drainBatch" << (1 << i) << ":" << batches_[i] << sep;								// number of wakeups which read [1<<i, 1<<(i+1)) messages (the last bucket: 1<<i or more)
+        }
+        ss << "drainBudgetHit:" << budgetHits_ << sep;													// number of wakeups stopped by the drain budget
         std::string s = ss.str();
         return s.substr(0, s.length() > sep.length() ? s.length() - sep.length() : std::string::npos);
     }
 protected:
     virtual void Thread() {
+        Affinity::Apply(Affinity::RECEIVER);
         try {
             Poll();
         } catch (boost::thread_interrupted&) {
@@ -262,9 +362,25 @@ protected:
         }
         ThreadExit();
     }
+    virtual bool Ready() {
+        // called from the reactor thread when the socket is readable or broken
+        SRT_SOCKSTATUS status = srt_getsockstate(sfd_);
+        if ((status == SRTS_BROKEN) || (status == SRTS_NONEXIST) || (status == SRTS_CLOSED)) {
+            Disconnected();
+            ThreadExit();
+            return false;
+        }
+        try {
+            Receive(msgctrl_);
+        } catch (boost::thread_interrupted&) {
+            throw;
+        } catch (std::exception& ev) {
+            errmsgs_ << boost::format("an unexpected exception occurred: %s") % ev.what();
+        }
+        return true;
+    }
     virtual void Poll() {
-        SRT_MSGCTRL msgctrl;
-        srt_msgctrl_init(&msgctrl);
+        SRT_MSGCTRL& msgctrl = msgctrl_;
         //msgctrl.flags = 0;       // Left for future
         //msgctrl.msgttl = -1;     // TTL for a message, default -1 (no TTL limitation)
         //msgctrl.inorder = false; // Whether a message is allowed to supersede partially lost one. Unused in stream and live mode.
@@ -272,12 +388,11 @@ protected:
         //msgctrl.srctime = 0;     // source timestamp (usec), 0: use internal time     
         //msgctrl.pktseq = 0;      // sequence number of the first packet in received message (unused for sending)
         //msgctrl.msgno = 0;       // message number (output value for both sending and receiving)
-        std::vector<char> buf;
-        int msTimeout = option_.Get<int>("epolltimeo", 100);
+        // no periodic wakeup; Destroy() and Reattach() release eid_ to end the wait
         std::vector<SRTSOCKET> srtrfds(1, SRT_INVALID_SOCK);
-        for (; eid_ >= 0; CheckFlag(), boost::this_thread::interruption_point()) {
+        for (; eid_ >= 0; Tick(), boost::this_thread::interruption_point()) {
             int srtrfdslen = static_cast<int>(srtrfds.size());
-            int n = srt_epoll_wait(eid_, &srtrfds.at(0), &srtrfdslen, 0, 0, msTimeout, 0, 0, 0, 0);
+            int n = srt_epoll_wait(eid_, &srtrfds.at(0), &srtrfdslen, 0, 0, Timeout(), 0, 0, 0, 0);
             for (int i = 0; i < n; ++i) {
                 //ASSERT(srtrfds[i] == sfd_);
                 SRT_SOCKSTATUS status = srt_getsockstate(sfd_);
@@ -285,15 +400,26 @@ protected:
                     Disconnected();
                     return;
                 }
-                Receive(buf, msgctrl);
+                Receive(msgctrl);
             }
         }
     }
+    virtual void Tick() {
+        if (pending_ && boost::chrono::steady_clock::now() >= pendingDeadline_) Flush();
+        CheckFlag();
+    }
+    virtual int Timeout() const {
+        // wake up only for the coalescing deadline (-1:until a message or an error)
+        if (!pending_) return -1;
+        int64_t ms = boost::chrono::duration_cast<boost::chrono::milliseconds>(pendingDeadline_ - boost::chrono::steady_clock::now()).count();
+        return static_cast<int>(std::max<int64_t>(ms, 1));
+    }
     virtual void CheckFlag() {
-        Event::vector_t events = Event::GetEvents(mutex_, events_);
-        for (Event::vector_t::iterator it = events.begin(); it != events.end(); ++it) {
-            Event::ptr_t ev = *it;
-            if (ev->GetReceiverFlag()) {
+        const Event::Set::entries_t& events = reader_();
+        for (Event::Set::entries_t::const_iterator it = events.begin(); it != events.end(); ++it) {
+            Event::ptr_t locked;
+            Event* ev = it->get(locked);
+            if (ev && ev->GetReceiverFlag()) {
                 if (!ev->OnReceiverFlag(option_)) {
                     ev->SetReceiverFlag(false);
                 }
@@ -301,50 +427,135 @@ protected:
         }
     }
     virtual void ThreadExit() {
-        Event::vector_t events = Event::GetEvents(mutex_, events_);
-        for (Event::vector_t::iterator it = events.begin(); it != events.end(); ++it) {
-            Event::ptr_t ev = *it;
-            ev->OnThreadExit(option_);
+        const Event::Set::entries_t& events = reader_();
+        for (Event::Set::entries_t::const_iterator it = events.begin(); it != events.end(); ++it) {
+            Event::ptr_t locked;
+            Event* ev = it->get(locked);
+            if (ev) ev->OnThreadExit(option_);
         }
     }
     virtual void Disconnected() {
+        Flush();
         srt_close(sfd_);
         sfd_ = SRT_INVALID_SOCK;
-        Event::vector_t events = Event::GetEvents(mutex_, events_);
-        for (Event::vector_t::iterator it = events.begin(); it != events.end(); ++it) {
-            Event::ptr_t ev = *it;
-            ev->OnDisconnected(option_);
+        const Event::Set::entries_t& events = reader_();
+        for (Event::Set::entries_t::const_iterator it = events.begin(); it != events.end(); ++it) {
+            Event::ptr_t locked;
+            Event* ev = it->get(locked);
+            if (ev) ev->OnDisconnected(option_);
         }
     }
-    virtual bool Receive(std::vector<char>& buf, SRT_MSGCTRL& msgctrl) {
-        Event::vector_t events = Event::GetEvents(mutex_, events_);
-        for (int count = 10; count >= 0 && eid_ >= 0; --count, boost::this_thread::interruption_point()) {
-            buf.resize(1500, 0);
+    virtual bool Receive(SRT_MSGCTRL& msgctrl) {
+        // drain until SRT_EASYNCRCV, bounded by the time and byte budgets so that other sockets get their turn
+        boost::chrono::steady_clock::time_point deadline = boost::chrono::steady_clock::now() + drainMs_;
+        size_t count = 0;
+        size_t bytes = 0;
+        bool result = true;
+        for (; running_; boost::this_thread::interruption_point()) {
+            boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now();
+            if (pending_ && now >= pendingDeadline_) Flush();
+            if ((drainBytes_ > 0 && bytes >= drainBytes_) || (drainMs_.count() > 0 && now >= deadline)) {
+                ++budgetHits_;
+                break;
+            }
+            Packet::mutable_ptr_t pkt = Packet::Create();
             int32_t lastMsgNo = msgctrl.msgno;
-            int ret = srt_recvmsg2(sfd_, buf.data(), static_cast<int>(buf.size()), &msgctrl);
+            int ret = srt_recvmsg2(sfd_, pkt->Data(), static_cast<int>(Packet::CAPACITY), &msgctrl);
             if (ret == SRT_ERROR) {
                 if (srt_getlasterror(nullptr) != SRT_EASYNCRCV) {
                     errmsgs_ << boost::format("failed srt_recvmsg2(): %s") % srt_getlasterror_str();
-                    return false;
+                    result = false;
                 }
                 break;
             }
             if (ret == 0) {
                 break;
             }
-            buf.resize(ret);
+            ++count;
+            bytes += ret;
+            pkt->Resize(ret);
+            pkt->SetTick(now);
+            pkt->SetSrcTime(msgctrl.srctime);
+            pkt->SetBoundary(msgctrl.boundary);
+            pkt->SetFlags(parser_.Inspect(pkt->Data(), pkt->Size())); // MpegTs::RAI/PAT/PMT are Packet::FLAG_RAP/PAT/PMT
             int diff = static_cast<int>(msgctrl.msgno - lastMsgNo);
             //TRACE(_T("%s: SRT Receive %ubytes%s\n"), CDateTime(TRUE, FALSE).ToStringISOLocal(), ret, diff > 1 ? _T(" *") : _T(""));
-            for (Event::vector_t::iterator it = events.begin(); it != events.end(); ++it) {
-                Event::ptr_t ev = *it;
-                if (!ev->OnReceive(option_, buf, diff > 1)) {
-                    // remove if owned event listener returns false
-                    boost::mutex::scoped_lock lk(mutex_);
-                    boost::range::remove_erase(own_events_, ev);
-                }
+            if (coalesceMs_.count() > 0) {
+                Coalesce(pkt, diff > 1, now);
+            } else {
+                Deliver(pkt, diff > 1);
             }
         }
-        return true;
+        if (count > 0) {
+            size_t bucket = 0;
+            while (bucket + 1 < BATCH_BUCKETS && (count >> (bucket + 1)) > 0) ++bucket;
+            ++batches_[bucket];
+        }
+        return result;
+    }
+    virtual void Deliver(const Packet::mutable_ptr_t& pkt, bool discrete) {
+        pkt->SetSeq(++seq_);
+        if (cacheBytes_ > 0) Cache(pkt);
+        const Event::Set::entries_t& events = reader_(); // picks up subscribers added since the last packet
+        for (Event::Set::entries_t::const_iterator it = events.begin(); it != events.end(); ++it) {
+            Event::ptr_t locked;
+            Event* ev = it->get(locked);
+            if (ev && !ev->OnReceive(option_, pkt, discrete) && it->own) {
+                // remove if owned event listener returns false
+                events_.Remove(it->hold);
+            }
+        }
+    }
+    virtual void Coalesce(const Packet::mutable_ptr_t& pkt, bool discrete, const boost::chrono::steady_clock::time_point& now) {
+        // pack whole TS packets of small messages into one live payload
+        bool ts = pkt->Size() % MpegTs::PACKET_SIZE == 0 && static_cast<uint8_t>(pkt->Data()[0]) == MpegTs::SYNC_BYTE;
+        if (!ts || pkt->Size() + MpegTs::PACKET_SIZE > COALESCE_SIZE) {
+            Flush();
+            Deliver(pkt, discrete);
+            return;
+        }
+        if (pending_ && pending_->Size() + pkt->Size() > COALESCE_SIZE) {
+            Flush();
+        }
+        if (!pending_) {
+            pending_ = pkt; // the first message keeps its buffer and receive tick
+            pendingDiscrete_ = discrete;
+            pendingDeadline_ = now + coalesceMs_;
+        } else {
+            memcpy(pending_->Data() + pending_->Size(), pkt->Data(), pkt->Size());
+            pending_->Resize(pending_->Size() + pkt->Size());
+            pending_->SetFlags(pending_->Flags() | pkt->Flags());
+            pending_->SetBoundary((pending_->Boundary() & 2) | (pkt->Boundary() & 1)); // start of the first, end of the last
+            pendingDiscrete_ = pendingDiscrete_ || discrete;
+        }
+        if (pending_->Size() + MpegTs::PACKET_SIZE > COALESCE_SIZE) {
+            Flush();
+        }
+    }
+    virtual void Flush() {
+        if (!pending_) return;
+        Packet::mutable_ptr_t pkt;
+        pkt.swap(pending_);
+        Deliver(pkt, pendingDiscrete_);
+    }
+    virtual void Cache(const Packet::ptr_t& pkt) {
+        boost::mutex::scoped_lock lk(cacheMutex_);
+        if (pkt->Flags() & Packet::FLAG_PAT) pat_ = pkt;
+        if (pkt->Flags() & Packet::FLAG_PMT) pmt_ = pkt;
+        if (pkt->IsRandomAccess()) {
+            cache_.clear();
+            cacheSize_ = 0;
+        } else if (cache_.empty()) {
+            return; // wait for the next random access point
+        }
+        if (cacheSize_ + pkt->Size() > cacheBytes_) {
+            // the GOP is larger than the cache
+            cache_.clear();
+            cacheSize_ = 0;
+            return;
+        }
+        cache_.push_back(pkt);
+        cacheSize_ += pkt->Size();
     }
 };
 
@@ -363,6 +574,9 @@ bool Receiver::Initialize() {
 void Receiver::Destroy() {
     pimpl_->Destroy();
 }
+bool Receiver::Reattach(int sfd) {
+    return pimpl_->Reattach(static_cast<SRTSOCKET>(sfd));
+}
 void Receiver::AddEvent(Event::wptr_t ev, int priority, bool own) {
     pimpl_->AddEvent(ev, priority, own);
 }
@@ -18,6 +18,7 @@ public:
     virtual ~Receiver();
     virtual bool Initialize();
     virtual void Destroy();
+    virtual bool Reattach(int sfd); // resume after a disconnection with a new socket, keeping the subscribers
     virtual void AddEvent(Event::wptr_t ev, int priority, bool own = false);
     virtual const ReceiveOption& GetOption() const;
     virtual std::string GetErrMsg(const std::string& sep = "\n") const;
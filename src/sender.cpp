@@ -10,10 +10,12 @@ class Sender::Impl
     Sender* owner_;
     SRTSOCKET sfd_;
     const SendOption option_;
+    const bool srctime_; // pass the source time through to srt_sendmsg2()
+    const int64_t started_;
     SafeMessages errmsgs_;
 public:
     Impl(Sender* owner, SRTSOCKET sfd, const SendOption& option)
-        : owner_(owner), sfd_(sfd), option_(option), errmsgs_() {
+        : owner_(owner), sfd_(sfd), option_(option), srctime_(option.Get<int>("srctime", 1) > 0), started_(srt_time_now()), errmsgs_() {
     }
     virtual ~Impl() {
         Destroy();
@@ -94,6 +96,26 @@ public:
         }
         return true;
     }
+    virtual int TrySend(const char* buf, size_t len, int64_t srctime, int boundary) {
+        if (sfd_ == SRT_INVALID_SOCK) {
+            return -1;
+        }
+        SRT_MSGCTRL msgctrl;
+        srt_msgctrl_init(&msgctrl);
+        msgctrl.boundary = boundary;
+        // srt rejects a source time before the socket was connected (e.g. a cached packet) or in the future
+        if (srctime_ && srctime >= started_ && srctime <= srt_time_now()) {
+            msgctrl.srctime = srctime;
+        }
+        if (srt_sendmsg2(sfd_, buf, static_cast<int>(len), &msgctrl) == SRT_ERROR) {
+            if (srt_getlasterror(nullptr) != SRT_EASYNCSND) {
+                errmsgs_ << boost::format("failed srt_sendmsg2(): %s") % srt_getlasterror_str();
+                return -1;
+            }
+            return 0; // the send buffer is full
+        }
+        return 1;
+    }
     virtual bool IsConnected() const {
         if (sfd_ == SRT_INVALID_SOCK) {
             return false;
@@ -241,6 +263,9 @@ void Sender::Destroy() {
 bool Sender::Send(const Event::buf_t& buf) {
     return pimpl_->Send(buf.data(), buf.size());
 }
+int Sender::TrySend(const Packet& pkt) {
+    return pimpl_->TrySend(pkt.Data(), pkt.Size(), pkt.SrcTime(), pkt.Boundary());
+}
 bool Sender::Send(const char* buf, size_t len) {
     return pimpl_->Send(buf, len);
 }
@@ -18,6 +18,7 @@ public:
     virtual bool Initialize();
     virtual void Destroy();
     virtual bool Send(const Event::buf_t& buf);
+    virtual int TrySend(const Packet& pkt); // 1:sent, 0:would block, -1:failed
     virtual bool Send(const char* buf, size_t len);
     virtual bool IsConnected() const;
     virtual const SendOption& GetOption() const;
@@ -17,6 +17,11 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <list>
+#include <set>
+#include <unordered_map>
+#include <deque>
+#include <functional>
 #include <chrono>
 #include <csignal>
 
@@ -27,8 +32,11 @@
 #include <boost/tokenizer.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/thread.hpp>
+#include <boost/atomic.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/circular_buffer.hpp>
 #include <boost/range/algorithm_ext/erase.hpp>
 #include <boost/json.hpp>
 #include <boost/tuple/tuple.hpp>
@@ -38,6 +46,8 @@
 #include <boost/xpressive/xpressive.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/endian/conversion.hpp>
+#include <boost/crc.hpp>
+#include <boost/align/aligned_alloc.hpp>
 
 #include <curl/curl.h>
 #include <srt/srt.h>
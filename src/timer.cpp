@@ -0,0 +1,257 @@
+﻿#include "stdafx.h"
+#include "timer.h"
+#include "logger.h"
+
+//----------------------------------------------------------------------------
+/// @class Timer::Wheel
+/// LEVELS wheels of SLOTS slots; a timer sits on the level which covers its distance
+/// and moves down when the slot of the upper level comes around
+//----------------------------------------------------------------------------
+class Timer::Wheel : private boost::noncopyable
+{
+    static const int BITS = 6;
+    static const size_t SLOTS = 1 << BITS;
+    static const size_t LEVELS = 4;        // 2^24 ticks; farther timers are carried on the top level
+    static const size_t DUE = LEVELS;      // level of the timers being run
+    struct Entry {
+        id_t id;
+        uint64_t expire; // tick
+        task_t task;
+    };
+    typedef std::list<Entry> slot_t;
+    struct Location {
+        size_t level;
+        size_t slot;
+        slot_t::iterator it;
+    };
+    typedef std::unordered_map<id_t, Location> index_t;
+    const boost::chrono::milliseconds resolution_;
+    const boost::chrono::steady_clock::time_point origin_;
+    uint64_t now_;                         // the last tick processed
+    slot_t slots_[LEVELS][SLOTS];
+    slot_t due_;
+    index_t index_;
+    id_t next_;
+    id_t running_;
+    bool cancelled_;                       // the running timer was cancelled
+    bool stop_;
+    boost::mutex mutex_;
+    boost::condition_variable cond_;
+    boost::condition_variable done_;
+    boost::thread thread_;
+    boost::atomic<uint64_t> fired_;
+    boost::atomic<uint64_t> wakeups_;
+public:
+    Wheel(int32_t resolution)
+        : resolution_(std::max<int32_t>(resolution, 1)), origin_(boost::chrono::steady_clock::now()), now_(0), due_(), index_(), next_(0), running_(0), cancelled_(false), stop_(false),
+        mutex_(), cond_(), done_(), thread_(), fired_(0), wakeups_(0) {
+    }
+    virtual ~Wheel() {
+        Destroy();
+    }
+    virtual bool Initialize() {
+        thread_ = boost::thread(&Wheel::Thread, this);
+        return true;
+    }
+    virtual void Destroy() {
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            stop_ = true;
+            cond_.notify_all();
+        }
+        if (thread_.joinable()) thread_.join();
+        boost::mutex::scoped_lock lock(mutex_);
+        for (size_t level = 0; level < LEVELS; ++level) {
+            for (size_t slot = 0; slot < SLOTS; ++slot) slots_[level][slot].clear();
+        }
+        due_.clear();
+        index_.clear();
+    }
+    virtual id_t Schedule(int64_t ms, const task_t& task) {
+        boost::mutex::scoped_lock lock(mutex_);
+        Entry entry = { ++next_, Expire(ms), task };
+        Insert(entry);
+        cond_.notify_one(); // the new timer may be the nearest
+        return entry.id;
+    }
+    virtual void Cancel(id_t id) {
+        boost::mutex::scoped_lock lock(mutex_);
+        index_t::iterator it = index_.find(id);
+        if (it != index_.end()) {
+            List(it->second).erase(it->second.it);
+            index_.erase(it);
+            return;
+        }
+        if (running_ != id) return;
+        cancelled_ = true;
+        if (boost::this_thread::get_id() == thread_.get_id()) return; // cancelled by itself
+        done_.wait(lock, [this, id]() { return running_ != id; });
+    }
+    virtual std::string GetStatistics(const std::string& sep) {
+        size_t timers = 0;
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            timers = index_.size();
+        }
+        std::stringstream ss;
+        ss << "timers:" << timers << sep;        // number of timers scheduled
+        ss << "timerFired:" << fired_ << sep;    // number of timers run
+        ss << "timerWakeups:" << wakeups_;       // number of times the timer thread woke up
+        return ss.str();
+    }
+protected:
+    virtual uint64_t Ticks() const {
+        return static_cast<uint64_t>((boost::chrono::steady_clock::now() - origin_) / resolution_);
+    }
+    virtual uint64_t Expire(int64_t ms) const {
+        uint64_t ticks = static_cast<uint64_t>((std::max<int64_t>(ms, 0) + resolution_.count() - 1) / resolution_.count());
+        return std::max(Ticks() + ticks, now_ + 1); // never on a tick already processed
+    }
+    virtual slot_t& List(const Location& location) {
+        return location.level == DUE ? due_ : slots_[location.level][location.slot];
+    }
+    virtual void Insert(const Entry& entry) {
+        // entry.expire >= now_; the slot of now_ on level 0 is run right after the cascade
+        uint64_t delta = entry.expire - now_;
+        uint64_t expire = entry.expire;
+        if (delta >= (1ull << (BITS * LEVELS))) {
+            expire = now_ + (1ull << (BITS * LEVELS)) - 1;
+            delta = expire - now_;
+        }
+        size_t level = 0;
+        while (level + 1 < LEVELS && delta >= (1ull << (BITS * (level + 1)))) ++level;
+        size_t slot = static_cast<size_t>((expire >> (BITS * level)) & (SLOTS - 1));
+        slot_t& list = slots_[level][slot];
+        list.push_back(entry);
+        Location location = { level, slot, --list.end() };
+        index_[entry.id] = location;
+    }
+    virtual void Cascade(size_t level) {
+        slot_t list;
+        list.swap(slots_[level][(now_ >> (BITS * level)) & (SLOTS - 1)]);
+        for (slot_t::const_iterator it = list.begin(); it != list.end(); ++it) {
+            Insert(*it);
+        }
+    }
+    virtual void Advance(uint64_t target) {
+        while (now_ < target) {
+            ++now_;
+            for (size_t level = LEVELS - 1; level > 0; --level) {
+                if ((now_ & ((1ull << (BITS * level)) - 1)) == 0) Cascade(level);
+            }
+            slot_t& slot = slots_[0][now_ & (SLOTS - 1)];
+            for (slot_t::iterator it = slot.begin(); it != slot.end();) {
+                if (it->expire > now_) {
+                    ++it;
+                    continue;
+                }
+                slot_t::iterator next = it;
+                ++next;
+                due_.splice(due_.end(), slot, it);
+                index_[it->id].level = DUE;
+                it = next;
+            }
+        }
+    }
+    virtual uint64_t Next() const {
+        // the nearest tick at which a slot is run or cascaded (0:none)
+        uint64_t next = 0;
+        for (size_t level = 0; level < LEVELS; ++level) {
+            uint64_t period = 1ull << (BITS * (level + 1));
+            uint64_t base = now_ & ~(period - 1);
+            for (size_t slot = 0; slot < SLOTS; ++slot) {
+                if (slots_[level][slot].empty()) continue;
+                uint64_t tick = base + (static_cast<uint64_t>(slot) << (BITS * level));
+                if (tick <= now_) tick += period;
+                if (next == 0 || tick < next) next = tick;
+            }
+        }
+        return next;
+    }
+    virtual void Run(boost::mutex::scoped_lock& lock) {
+        while (!due_.empty() && !stop_) {
+            Entry entry = due_.front();
+            due_.pop_front();
+            index_.erase(entry.id);
+            running_ = entry.id;
+            cancelled_ = false;
+            lock.unlock();
+            int64_t ms = 0;
+            try {
+                ms = entry.task();
+            } catch (std::exception& ex) {
+                Logger::Error(boost::format("timer : an unexpected exception occurred: %s") % ex.what());
+            }
+            ++fired_;
+            lock.lock();
+            running_ = 0;
+            done_.notify_all();
+            if (ms > 0 && !cancelled_) {
+                entry.expire = Expire(ms);
+                Insert(entry);
+            }
+        }
+    }
+    virtual void Thread() {
+        boost::mutex::scoped_lock lock(mutex_);
+        while (!stop_) {
+            uint64_t next = Next();
+            if (next == 0) {
+                cond_.wait(lock);
+            } else {
+                cond_.wait_until(lock, origin_ + resolution_ * next);
+            }
+            ++wakeups_;
+            Advance(Ticks());
+            Run(lock);
+        }
+    }
+};
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+Timer::pwheel_t Timer::pwheel_;
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+bool Timer::Init(const Json::Node& conf) {
+    if (pwheel_) return true;
+    int32_t resolution = conf["resolution"].to<int32_t>(10);
+    pwheel_.reset(new Wheel(resolution));
+    if (pwheel_->Initialize()) {
+        Logger::Info(boost::format("timer : resolution %d msec") % resolution);
+        return true;
+    }
+    pwheel_.reset();
+    return false;
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+void Timer::Term() {
+    pwheel_.reset();
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+Timer::id_t Timer::Schedule(int64_t ms, const task_t& task) {
+    return pwheel_ ? pwheel_->Schedule(ms, task) : 0;
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+void Timer::Cancel(id_t id) {
+    if (pwheel_ && id) pwheel_->Cancel(id);
+}
+
+//----------------------------------------------------------------------------
+//
+//----------------------------------------------------------------------------
+std::string Timer::GetStatistics(const std::string& sep) {
+    return pwheel_ ? pwheel_->GetStatistics(sep) : std::string();
+}
@@ -0,0 +1,22 @@
+﻿#pragma once
+
+#include "json.h"
+
+//----------------------------------------------------------------------------
+/// @class Timer
+/// hierarchical timer wheel on one thread which sleeps until the next deadline
+//----------------------------------------------------------------------------
+class Timer
+{
+    class Wheel;
+    typedef boost::scoped_ptr<Wheel> pwheel_t;
+    static pwheel_t pwheel_;
+public:
+    typedef uint64_t id_t;
+    typedef std::function<int64_t()> task_t; // runs on the timer thread; returns msec until the next run (0:done)
+    static bool Init(const Json::Node& conf);
+    static void Term();
+    static id_t Schedule(int64_t ms, const task_t& task); // 0 if the timer is not running
+    static void Cancel(id_t id); // waits for the task if it is running on another thread
+    static std::string GetStatistics(const std::string& sep = ", ");
+};